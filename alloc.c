@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+#define WORD_BITS 64
+#define EDGE_EMPTY 0xFFFFFFFFu
+
+// Stops the program when the index of free runs cannot grow. Without it
+// the allocator no longer knows where the free blocks are.
+static void no_memory()
+{
+	perror("alloc");
+	exit(1);
+}
+
+// Prepares an allocator for n blocks with every block marked as used.
+// Blocks below first_data are never handed out.
+int alloc_init( allocator *a, int n, int first_data )
+{
+	alloc_destroy(a);
+	a->n_words = (n + WORD_BITS - 1) / WORD_BITS;
+	a->n_summary = (a->n_words + WORD_BITS - 1) / WORD_BITS;
+	a->map = calloc(a->n_words, sizeof(uint64_t));
+	a->summary = calloc(a->n_summary, sizeof(uint64_t));
+	a->edge_bits = 6;
+	a->edges = malloc(sizeof(alloc_edge) << a->edge_bits);
+	if(!a->map || !a->summary || !a->edges) {
+		alloc_destroy(a);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(a->edges, 0xff, sizeof(alloc_edge) << a->edge_bits);
+	a->n_blocks = n;
+	a->first_block = first_data;
+	a->n_free = 0;
+	a->hint = first_data / WORD_BITS;
+	return 0;
+}
+
+// Releases the allocator memory
+void alloc_destroy( allocator *a )
+{
+	free(a->map);
+	free(a->summary);
+	free(a->runs);
+	free(a->edges);
+	a->map = a->summary = NULL;
+	a->runs = NULL;
+	a->edges = NULL;
+	a->n_words = a->n_summary = a->n_blocks = a->n_free = 0;
+	a->runs_capacity = a->n_runs = 0;
+	a->free_run = -1;
+	for(int k = 0; k < ALLOC_CLASSES; k++) a->class[k] = -1;
+	a->classes = 0;
+}
+
+// Finds the first word at or after w with a free block, or -1
+static int find_word( allocator *a, int w )
+{
+	int s = w / WORD_BITS;
+	uint64_t bits = a->summary[s] & (~0ULL << (w % WORD_BITS));
+	while(!bits) {
+		if(++s >= a->n_summary) return -1;
+		bits = a->summary[s];
+	}
+	return s * WORD_BITS + __builtin_ctzll(bits);
+}
+
+// Returns the last used block before the free block b. Blocks below
+// first_block are never free, so there is always one.
+static int prev_used( allocator *a, int b )
+{
+	int w = b / WORD_BITS;
+	uint64_t bits = ~a->map[w] & ((1ULL << (b % WORD_BITS)) - 1);
+	while(!bits) bits = ~a->map[--w];
+	return w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(bits);
+}
+
+// Returns 1 if block is free
+int alloc_is_free( allocator *a, int block )
+{
+	if(block < a->first_block || block >= a->n_blocks) return 0;
+	return a->map[block / WORD_BITS] >> (block % WORD_BITS) & 1;
+}
+
+// Slot of the edge hash where the search for key starts
+static uint32_t edge_slot( allocator *a, uint32_t key )
+{
+	return (key * 2654435761u) >> (32 - a->edge_bits);
+}
+
+// Returns the run with the edge key, or -1
+static int edge_find( allocator *a, uint32_t key )
+{
+	uint32_t mask = (1u << a->edge_bits) - 1;
+	for(uint32_t i = edge_slot(a, key); a->edges[i].key != EDGE_EMPTY; i = (i + 1) & mask)
+		if(a->edges[i].key == key) return a->edges[i].run;
+	return -1;
+}
+
+static void edge_put( allocator *a, uint32_t key, int run )
+{
+	uint32_t mask = (1u << a->edge_bits) - 1;
+	uint32_t i = edge_slot(a, key);
+	while(a->edges[i].key != EDGE_EMPTY) i = (i + 1) & mask;
+	a->edges[i].key = key;
+	a->edges[i].run = run;
+}
+
+// Removes an edge. The entries after it that would no longer be found
+// from their own slot are moved back into the gap.
+static void edge_del( allocator *a, uint32_t key )
+{
+	uint32_t mask = (1u << a->edge_bits) - 1;
+	uint32_t i = edge_slot(a, key);
+	while(a->edges[i].key != key) {
+		if(a->edges[i].key == EDGE_EMPTY) return;
+		i = (i + 1) & mask;
+	}
+	for(uint32_t j = (i + 1) & mask; a->edges[j].key != EDGE_EMPTY; j = (j + 1) & mask) {
+		uint32_t home = edge_slot(a, a->edges[j].key);
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			a->edges[i] = a->edges[j];
+			i = j;
+		}
+	}
+	a->edges[i].key = EDGE_EMPTY;
+}
+
+// Doubles the edge hash
+static void edges_grow( allocator *a )
+{
+	alloc_edge *old = a->edges;
+	int old_size = 1 << a->edge_bits;
+	a->edges = malloc(sizeof(alloc_edge) << (a->edge_bits + 1));
+	if(!a->edges) no_memory();
+	a->edge_bits++;
+	memset(a->edges, 0xff, sizeof(alloc_edge) << a->edge_bits);
+	for(int i = 0; i < old_size; i++)
+		if(old[i].key != EDGE_EMPTY) edge_put(a, old[i].key, old[i].run);
+	free(old);
+}
+
+static int size_class( int length )
+{
+	return 31 - __builtin_clz(length);
+}
+
+// Puts a run first in the list of its size class
+static void class_link( allocator *a, int r )
+{
+	alloc_run *run = &a->runs[r];
+	int k = size_class(run->length);
+	run->prev = -1;
+	run->next = a->class[k];
+	if(run->next >= 0) a->runs[run->next].prev = r;
+	a->class[k] = r;
+	a->classes |= 1u << k;
+}
+
+static void class_unlink( allocator *a, int r )
+{
+	alloc_run *run = &a->runs[r];
+	int k = size_class(run->length);
+	if(run->prev >= 0) a->runs[run->prev].next = run->next;
+	else a->class[k] = run->next;
+	if(run->next >= 0) a->runs[run->next].prev = run->prev;
+	if(a->class[k] < 0) a->classes &= ~(1u << k);
+}
+
+// Adds a run of free blocks to the index
+static void run_add( allocator *a, int start, int length )
+{
+	if(a->free_run < 0) {
+		int capacity = a->runs_capacity ? a->runs_capacity * 2 : 64;
+		alloc_run *runs = realloc(a->runs, capacity * sizeof(alloc_run));
+		if(!runs) no_memory();
+		for(int i = a->runs_capacity; i < capacity; i++) {
+			runs[i].length = 0;
+			runs[i].next = i + 1 < capacity ? i + 1 : -1;
+		}
+		a->free_run = a->runs_capacity;
+		a->runs = runs;
+		a->runs_capacity = capacity;
+	}
+	if(4 * (a->n_runs + 1) > 1 << a->edge_bits) edges_grow(a); // At most half full
+	int r = a->free_run;
+	a->free_run = a->runs[r].next;
+	a->runs[r].start = start;
+	a->runs[r].length = length;
+	class_link(a, r);
+	edge_put(a, 2u * start, r);
+	edge_put(a, 2u * (start + length - 1) + 1, r);
+	a->n_runs++;
+}
+
+static void run_remove( allocator *a, int r )
+{
+	alloc_run *run = &a->runs[r];
+	class_unlink(a, r);
+	edge_del(a, 2u * run->start);
+	edge_del(a, 2u * (run->start + run->length - 1) + 1);
+	run->length = 0;
+	run->next = a->free_run;
+	a->free_run = r;
+	a->n_runs--;
+}
+
+// Moves the edges of a run, keeping it in the index
+static void run_set( allocator *a, int r, int start, int length )
+{
+	alloc_run *run = &a->runs[r];
+	int end = run->start + run->length - 1;
+	int moves = size_class(length) != size_class(run->length);
+	if(moves) class_unlink(a, r);
+	if(start != run->start) {
+		edge_del(a, 2u * run->start);
+		edge_put(a, 2u * start, r);
+	}
+	if(start + length - 1 != end) {
+		edge_del(a, 2u * end + 1);
+		edge_put(a, 2u * (start + length - 1) + 1, r);
+	}
+	run->start = start;
+	run->length = length;
+	if(moves) class_link(a, r);
+}
+
+// Returns the run holding the free block b. Blocks are mostly taken at the
+// start of a run; otherwise the bitmap is walked back to where it starts.
+static int run_of( allocator *a, int b )
+{
+	int r = edge_find(a, 2u * b);
+	return r >= 0 ? r : edge_find(a, 2u * (prev_used(a, b) + 1));
+}
+
+// Marks count free blocks from start, all in one run, as used
+static void take( allocator *a, int start, int count )
+{
+	int r = run_of(a, start);
+	int first = a->runs[r].start, end = first + a->runs[r].length;
+	for(int b = start; b < start + count; b++) {
+		int w = b / WORD_BITS;
+		a->map[w] &= ~(1ULL << (b % WORD_BITS));
+		if(!a->map[w]) a->summary[w / WORD_BITS] &= ~(1ULL << (w % WORD_BITS));
+	}
+	a->n_free -= count;
+
+	if(start > first) {
+		run_set(a, r, first, start - first);
+		if(start + count < end) run_add(a, start + count, end - start - count);
+	} else if(start + count < end) {
+		run_set(a, r, start + count, end - start - count);
+	} else {
+		run_remove(a, r);
+	}
+}
+
+// Marks count used blocks from start as free, joining them to the free
+// runs around them
+static void release( allocator *a, int start, int count )
+{
+	int end = start + count;
+	for(int b = start; b < end; b++) {
+		int w = b / WORD_BITS;
+		a->map[w] |= 1ULL << (b % WORD_BITS);
+		a->summary[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+	}
+	a->n_free += count;
+
+	int left = alloc_is_free(a, start - 1) ? edge_find(a, 2u * (start - 1) + 1) : -1;
+	int right = alloc_is_free(a, end) ? edge_find(a, 2u * end) : -1;
+	if(left >= 0 && right >= 0) {
+		int last = a->runs[right].start + a->runs[right].length;
+		run_remove(a, right);
+		run_set(a, left, a->runs[left].start, last - a->runs[left].start);
+	} else if(left >= 0) {
+		run_set(a, left, a->runs[left].start, end - a->runs[left].start);
+	} else if(right >= 0) {
+		run_set(a, right, start, a->runs[right].start + a->runs[right].length - start);
+	} else {
+		run_add(a, start, count);
+	}
+}
+
+// Returns the first block of one of the longest free runs, with its length
+// in *length, or -1 if nothing is free. It is the first run of the highest
+// size class, so it is at least half as long as the longest one.
+int alloc_longest( allocator *a, int *length )
+{
+	if(!a->classes) {
+		*length = 0;
+		return -1;
+	}
+	alloc_run *run = &a->runs[a->class[size_class(a->classes)]];
+	*length = run->length;
+	return run->start;
+}
+
+// Takes up to want consecutive free blocks and returns the first one, with
+// their number in *got. The run starts at goal when that block is free, so
+// a file keeps growing in place; otherwise it is one of the longest free
+// runs. Returns -1 with errno=ENOSPC if the disk is full.
+int alloc_extent( allocator *a, int goal, int want, int *got )
+{
+	int start, length;
+	if(!a->n_free) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if(want < 1) want = 1;
+
+	if(alloc_is_free(a, goal)) {
+		alloc_run *run = &a->runs[run_of(a, goal)];
+		start = goal;
+		length = run->start + run->length - goal;
+	} else {
+		start = alloc_longest(a, &length);
+	}
+	if(length > want) length = want;
+	take(a, start, length);
+	*got = length;
+	return start;
+}
+
+// Takes a free block, searching from where the last one was found (next fit).
+// Returns the block number, or -1 with errno=ENOSPC if the disk is full.
+int alloc_get( allocator *a )
+{
+	if(!a->n_free) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	int w = find_word(a, a->hint);
+	if(w < 0) w = find_word(a, 0); // Wrap around
+
+	int block = w * WORD_BITS + __builtin_ctzll(a->map[w]);
+	take(a, block, 1);
+	a->hint = w;
+	return block;
+}
+
+// Gives back the used blocks among count blocks from start. Blocks that
+// are never handed out are left alone.
+void alloc_release_run( allocator *a, int start, int count )
+{
+	int end = start + count;
+	if(start < a->first_block) start = a->first_block;
+	if(end > a->n_blocks) end = a->n_blocks;
+	while(start < end) {
+		if(alloc_is_free(a, start)) {
+			start++;
+			continue;
+		}
+		int stop = start + 1;
+		while(stop < end && !alloc_is_free(a, stop)) stop++;
+		release(a, start, stop - start);
+		start = stop;
+	}
+}
+
+// Gives a block back to the allocator
+void alloc_release( allocator *a, unsigned int block )
+{
+	if(block < (unsigned int)a->n_blocks) alloc_release_run(a, (int)block, 1);
+}
+
+// Takes a given block if it is free
+void alloc_take( allocator *a, int block )
+{
+	if(alloc_is_free(a, block)) take(a, block, 1);
+}
+
+// Returns the number of free blocks
+int alloc_free_count( allocator *a )
+{
+	return a->n_free;
+}
+
+// Returns the number of runs of free blocks, and the length of the longest
+// one in *largest
+int alloc_free_runs( allocator *a, int *largest )
+{
+	*largest = 0;
+	if(a->classes)
+		for(int r = a->class[size_class(a->classes)]; r >= 0; r = a->runs[r].next)
+			if(a->runs[r].length > *largest) *largest = a->runs[r].length;
+	return a->n_runs;
+}
@@ -0,0 +1,61 @@
+// Free-block allocator: a two-level bitmap of the data blocks, built at
+// mount time, with a running count of free blocks, and an index of the
+// runs of free blocks by size. Blocks are handed out in extents: a file
+// grows in place while the block after its last one is free, and otherwise
+// starts a new extent in one of the longest free runs.
+// Single blocks are taken next-fit, from where the last one was found.
+
+#include <stdint.h>
+
+// A run of free blocks, linked in the list of runs of the same size class
+typedef struct{
+	int start;              // First block
+	int length;             // Number of blocks, 0 if the entry is unused
+	int prev, next;         // Neighbours in the size class list, -1 at the ends
+} alloc_run;
+
+// An entry of the hash of run edges: the first block of a run, keyed by
+// 2 * block, or its last block, keyed by 2 * block + 1
+typedef struct{
+	uint32_t key;           // EDGE_EMPTY if the entry is unused
+	int run;                // Run with that edge
+} alloc_edge;
+
+#define ALLOC_CLASSES 32    // Size classes: class k holds runs of 2^k to 2^(k+1)-1 blocks
+
+// A set bit in map means the block is free. A set bit in summary means the
+// corresponding word of map has at least one free block, so a search skips
+// 64*64 allocated blocks per summary word. Every maximal run of free blocks
+// is in runs, found by its edges through edges and by its size through
+// class.
+typedef struct{
+	uint64_t *map;          // One bit per block
+	uint64_t *summary;      // One bit per word of map
+	int n_words;            // Number of words in map
+	int n_summary;          // Number of words in summary
+	int n_blocks;           // Total number of blocks tracked
+	int first_block;        // First block that may be handed out
+	int n_free;             // Number of free blocks
+	int hint;               // Word of map where alloc_get searches next
+
+	alloc_run *runs;        // Runs of free blocks, and unused entries
+	int runs_capacity;      // Entries in runs
+	int n_runs;             // Runs in use
+	int free_run;           // First unused entry of runs, linked by next, -1 if none
+	alloc_edge *edges;      // Open addressing hash of the run edges
+	int edge_bits;          // The hash has 2^edge_bits entries
+	int class[ALLOC_CLASSES]; // First run of each size class, -1 if none
+	uint32_t classes;       // Bit k set if class k has a run
+} allocator;
+
+int  alloc_init( allocator *a, int number_blocks, int first_data );
+void alloc_destroy( allocator *a );
+int  alloc_get( allocator *a );
+int  alloc_extent( allocator *a, int goal, int want, int *got );
+int  alloc_longest( allocator *a, int *length );
+int  alloc_is_free( allocator *a, int block );
+void alloc_release( allocator *a, unsigned int block );
+void alloc_release_run( allocator *a, int start, int count );
+void alloc_take( allocator *a, int block );
+int  alloc_free_count( allocator *a );
+int  alloc_free_runs( allocator *a, int *largest );
@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ds.h"
+#include "fat.h"
+
+// Benchmark of the fat_* API. Each workload runs on a freshly formatted
+// image and prints one CSV line (mt prints one per thread count):
+// operations per second, MB/s, latency percentiles and blocks read and
+// written per operation.
+
+static int blocks = 65536;          // Size of each image, set with -n
+static int backend = DS_STDIO;      // Disk backend, set with -b
+static const char *backend_name = "stdio";
+static int cache = DS_CACHE_DEFAULT; // Blocks in the disk cache, set with -c
+static int delalloc = 0;            // 1 for delayed allocation, set with -d
+static int fat_pages = 0;           // FAT blocks in memory when loaded on demand, set with -f
+#define MT_RUNS 16
+#define MT_MAX 64
+static int thread_counts[MT_RUNS] = { 1, 2, 4, 8 }; // Threads of each mt run, set with -j
+static int mt_runs = 4;             // Entries in thread_counts
+static int scale = 1;               // Multiplies the size of every workload, set with -s
+static const char *image = "/tmp/fat-bench.img"; // Image file, set with -i
+static const char *trace = NULL;    // Trace for the replay workload, set with -r
+
+// A workload in progress: the disk and file system it runs on and the
+// latency of each operation
+typedef struct{
+	ds_disk *disk;
+	fat_fs *fs;
+	double *lat;     // Latency of each operation, in microseconds
+	int ops;         // Operations recorded
+	int capacity;    // Room in lat
+	long bytes;      // File data moved by the operations
+	pthread_mutex_t lock;
+} run;
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Records an operation that started at start and moved bytes of file data
+static void record( run *r, double start, long bytes )
+{
+	double us = (now() - start) * 1e6;
+	pthread_mutex_lock(&r->lock);
+	if(r->ops == r->capacity) {
+		r->capacity = r->capacity ? r->capacity * 2 : 4096;
+		r->lat = realloc(r->lat, r->capacity * sizeof(double));
+		if(!r->lat) {
+			perror("bench");
+			exit(1);
+		}
+	}
+	r->lat[r->ops++] = us;
+	r->bytes += bytes;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void fail( const char *what )
+{
+	fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void fill( char *buff, int length, unsigned seed )
+{
+	for(int i = 0; i < length; i++) buff[i] = (char)(seed + i * 131);
+}
+
+// Fails unless buff holds what fill wrote with seed
+static void verify( const char *buff, int length, unsigned seed, const char *name, long offset )
+{
+	for(int i = 0; i < length; i++) {
+		if(buff[i] != (char)(seed + i * 131)) {
+			fprintf(stderr, "bench: %s: dados errados no offset %ld\n", name, offset + i);
+			exit(1);
+		}
+	}
+}
+
+// Formats and mounts a new image
+static void setup( run *r )
+{
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	unlink(image);
+	r->disk = ds_new();
+	if(!r->disk || !ds_backend(r->disk, backend) || !ds_cache(r->disk, cache)) fail("disco");
+	if(!ds_init(r->disk, image, blocks)) fail(image);
+	r->fs = fat_new(r->disk);
+	if(!r->fs || fat_format(r->fs) || fat_set_lazy(r->fs, fat_pages) || fat_mount(r->fs)) fail("formatar");
+	fat_set_delalloc(r->fs, delalloc);
+}
+
+// Creates a file and writes size bytes to it, in chunks of chunk bytes,
+// without recording anything. Used to prepare the read workloads.
+static void prepare( run *r, char *name, long size, int chunk )
+{
+	char *buff = malloc(chunk);
+	if(!buff) fail("memoria");
+	if(fat_create(r->fs, name)) fail(name);
+	int fd = fat_open(r->fs, name);
+	if(fd < 0) fail(name);
+	for(long offset = 0; offset < size; offset += chunk) {
+		int n = size - offset < chunk ? size - offset : chunk;
+		fill(buff, n, offset);
+		if(fat_pwrite(r->fs, fd, buff, n, offset) != n) fail(name);
+	}
+	if(fat_close(r->fs, fd)) fail(name);
+	free(buff);
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Prints the results of a workload measured from start, with the disk
+// counters it began with, and releases the image. ds_close prints its own
+// counters; they go to /dev/null so the output stays CSV.
+static void report( run *r, const char *name, double start, int reads, int writes )
+{
+	fat_flush(r->fs);
+	ds_flush(r->disk);
+	double secs = now() - start;
+	reads = ds_reads(r->disk) - reads;
+	writes = ds_writes(r->disk) - writes;
+	fat_frag frag;
+	fat_fragmentation(r->fs, &frag);
+
+	if(r->lat) qsort(r->lat, r->ops, sizeof(double), cmp_double);
+	double p50 = r->lat ? r->lat[r->ops / 2] : 0;
+	double p99 = r->lat ? r->lat[(int)(r->ops * 0.99)] : 0;
+	int ops = r->ops ? r->ops : 1;
+	printf("%s,%s,%d,%.6f,%.1f,%.2f,%.1f,%.1f,%.3f,%.3f,%d\n",
+	       name, backend_name, r->ops, secs, r->ops / secs, r->bytes / secs / 1e6,
+	       p50, p99, (double)reads / ops, (double)writes / ops, frag.extents);
+	fflush(stdout);
+
+	fat_free(r->fs);
+	int out = dup(1), null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	ds_free(r->disk);
+	fflush(stdout);
+	dup2(out, 1);
+	close(out);
+	close(null);
+	unlink(image);
+	free(r->lat);
+	pthread_mutex_destroy(&r->lock);
+}
+
+// Many small files: each is created, written once and deleted later
+static void bench_create_delete()
+{
+	run r;
+	setup(&r);
+	int files = 2000 * scale;
+	char name[32], buff[512];
+	fill(buff, sizeof(buff), 1);
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	for(int i = 0; i < files; i++) {
+		sprintf(name, "f%d", i);
+		t = now();
+		if(fat_create(r.fs, name)) fail(name);
+		record(&r, t, 0);
+		t = now();
+		if(fat_write(r.fs, name, buff, sizeof(buff), 0) != sizeof(buff)) fail(name);
+		record(&r, t, sizeof(buff));
+	}
+	for(int i = 0; i < files; i++) {
+		sprintf(name, "f%d", i);
+		t = now();
+		if(fat_delete(r.fs, name)) fail(name);
+		record(&r, t, 0);
+	}
+	report(&r, "create_delete", start, reads, writes);
+}
+
+// A large file written from start to end, as importar does
+static void bench_seq_write()
+{
+	run r;
+	setup(&r);
+	long size = (64L << 20) * scale;
+	int chunk = 256 << 10;
+	char *buff = malloc(chunk);
+	if(!buff) fail("memoria");
+	if(fat_create(r.fs, "seq")) fail("seq");
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	int fd = fat_open(r.fs, "seq");
+	for(long offset = 0; offset < size; offset += chunk) {
+		fill(buff, chunk, offset);
+		t = now();
+		if(fat_pwrite(r.fs, fd, buff, chunk, offset) != chunk) fail("seq");
+		record(&r, t, chunk);
+	}
+	t = now();
+	if(fat_close(r.fs, fd)) fail("seq");
+	record(&r, t, 0);
+	free(buff);
+	report(&r, "seq_write", start, reads, writes);
+}
+
+// A large file read from start to end, as exportar does
+static void bench_seq_read()
+{
+	run r;
+	setup(&r);
+	long size = (64L << 20) * scale;
+	int chunk = 256 << 10;
+	prepare(&r, "seq", size, chunk);
+	char *buff = malloc(chunk);
+	if(!buff) fail("memoria");
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	int fd = fat_open(r.fs, "seq");
+	for(long offset = 0; offset < size; offset += chunk) {
+		t = now();
+		if(fat_pread(r.fs, fd, buff, chunk, offset) != chunk) fail("seq");
+		record(&r, t, chunk);
+	}
+	fat_close(r.fs, fd);
+	free(buff);
+	report(&r, "seq_read", start, reads, writes);
+}
+
+// Reads or overwrites of one block at random offsets of a large file
+static void bench_random( int write )
+{
+	run r;
+	setup(&r);
+	long size = (64L << 20) * scale;
+	int ops = 4000 * scale;
+	char buff[BLOCK_SIZE];
+	fill(buff, sizeof(buff), 3);
+	prepare(&r, "rnd", size, 1 << 20);
+	srand(1);
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	int fd = fat_open(r.fs, "rnd");
+	for(int i = 0; i < ops; i++) {
+		long offset = ((long)rand() * RAND_MAX + rand()) % (size - sizeof(buff));
+		t = now();
+		int n = write ? fat_pwrite(r.fs, fd, buff, sizeof(buff), offset)
+		              : fat_pread(r.fs, fd, buff, sizeof(buff), offset);
+		if(n != sizeof(buff)) fail("rnd");
+		record(&r, t, n);
+	}
+	fat_close(r.fs, fd);
+	report(&r, write ? "random_write" : "random_read", start, reads, writes);
+}
+
+// Several files growing at once by small appends, taking turns, which
+// fragments them unless the allocator keeps them apart. Fails if they end
+// up with more than 4 extents per file.
+static void bench_interleaved()
+{
+	run r;
+	setup(&r);
+	int files = 16, appends = 256 * scale, chunk = 4096;
+	int fds[16];
+	char name[32], buff[4096];
+	fill(buff, chunk, 7);
+	for(int i = 0; i < files; i++) {
+		sprintf(name, "i%d", i);
+		if(fat_create(r.fs, name)) fail(name);
+	}
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	for(int i = 0; i < files; i++) {
+		sprintf(name, "i%d", i);
+		fds[i] = fat_open(r.fs, name);
+		if(fds[i] < 0) fail(name);
+	}
+	for(int k = 0; k < appends; k++) {
+		for(int i = 0; i < files; i++) {
+			t = now();
+			if(fat_pwrite(r.fs, fds[i], buff, chunk, k * chunk) != chunk) fail("interleaved");
+			record(&r, t, chunk);
+		}
+	}
+	for(int i = 0; i < files; i++) fat_close(r.fs, fds[i]);
+
+	// each file should stay in one extent or close to it
+	fat_frag frag;
+	fat_flush(r.fs);
+	fat_fragmentation(r.fs, &frag);
+	if(frag.extents > 4 * files) {
+		fprintf(stderr, "bench: interleaved: %d extentes em %d arquivos\n", frag.extents, files);
+		exit(1);
+	}
+	report(&r, "interleaved", start, reads, writes);
+}
+
+// Threads working at once through one file system, checking every byte
+// they read back. Each thread writes and reads a file of its own, then
+// reads random chunks of a file shared by all of them, then creates small
+// files, which grows the directory, and reads back and deletes the files
+// created by the next thread. One line is printed per thread count.
+static run *mt_run;
+static int mt_threads;              // Threads of the run in progress
+static long mt_size;                // Bytes of each thread's file and of the shared file
+static pthread_barrier_t mt_barrier;
+
+#define MT_CHUNK (64 << 10)
+#define MT_SMALL 3000               // Bytes of each small file
+
+static void *mt_worker( void *arg )
+{
+	long id = (long)arg;
+	int files = 200 * scale;
+	char name[32], *buff = malloc(MT_CHUNK);
+	if(!buff) fail("memoria");
+	double t;
+
+	// a file of its own, written and read back
+	sprintf(name, "t%ld", id);
+	int fd = fat_open(mt_run->fs, name);
+	if(fd < 0) fail(name);
+	for(long offset = 0; offset < mt_size; offset += MT_CHUNK) {
+		fill(buff, MT_CHUNK, offset + id);
+		t = now();
+		if(fat_pwrite(mt_run->fs, fd, buff, MT_CHUNK, offset) != MT_CHUNK) fail(name);
+		record(mt_run, t, MT_CHUNK);
+	}
+	for(long offset = 0; offset < mt_size; offset += MT_CHUNK) {
+		t = now();
+		if(fat_pread(mt_run->fs, fd, buff, MT_CHUNK, offset) != MT_CHUNK) fail(name);
+		record(mt_run, t, MT_CHUNK);
+		verify(buff, MT_CHUNK, offset + id, name, offset);
+	}
+	fat_close(mt_run->fs, fd);
+
+	// random chunks of the shared file, read by every thread at once
+	unsigned seed = id + 1;
+	fd = fat_open(mt_run->fs, "shared");
+	if(fd < 0) fail("shared");
+	for(long i = 0; i < mt_size / MT_CHUNK; i++) {
+		long offset = rand_r(&seed) % (mt_size / MT_CHUNK) * MT_CHUNK;
+		t = now();
+		if(fat_pread(mt_run->fs, fd, buff, MT_CHUNK, offset) != MT_CHUNK) fail("shared");
+		record(mt_run, t, MT_CHUNK);
+		verify(buff, MT_CHUNK, offset, "shared", offset);
+	}
+	fat_close(mt_run->fs, fd);
+
+	// small files created here and deleted by the next thread
+	for(int k = 0; k < files; k++) {
+		sprintf(name, "c%ld_%d", id, k);
+		fill(buff, MT_SMALL, id * files + k);
+		t = now();
+		if(fat_create(mt_run->fs, name)) fail(name);
+		if(fat_write(mt_run->fs, name, buff, MT_SMALL, 0) != MT_SMALL) fail(name);
+		record(mt_run, t, MT_SMALL);
+	}
+	pthread_barrier_wait(&mt_barrier);
+	long owner = (id + 1) % mt_threads;
+	for(int k = 0; k < files; k++) {
+		sprintf(name, "c%ld_%d", owner, k);
+		t = now();
+		if(fat_read(mt_run->fs, name, buff, MT_SMALL, 0) != MT_SMALL) fail(name);
+		if(fat_delete(mt_run->fs, name)) fail(name);
+		record(mt_run, t, MT_SMALL);
+		verify(buff, MT_SMALL, owner * files + k, name, 0);
+	}
+	free(buff);
+	return NULL;
+}
+
+static void bench_mt()
+{
+	for(int j = 0; j < mt_runs; j++) {
+		run r;
+		setup(&r);
+		pthread_t th[MT_MAX];
+		char name[32];
+		mt_threads = thread_counts[j];
+		// every thread gets the same work, unless the image is too small for it
+		mt_size = (16L << 20) * scale;
+		long room = (long)blocks * BLOCK_SIZE / 2 / (mt_threads + 1) / MT_CHUNK * MT_CHUNK;
+		if(mt_size > room) mt_size = room;
+		if(mt_size < MT_CHUNK) {
+			errno = ENOSPC;
+			fail("mt");
+		}
+		prepare(&r, "shared", mt_size, MT_CHUNK);
+		for(long i = 0; i < mt_threads; i++) {
+			sprintf(name, "t%ld", i);
+			if(fat_create(r.fs, name)) fail(name);
+		}
+		pthread_barrier_init(&mt_barrier, NULL, mt_threads);
+		mt_run = &r;
+		double start = now();
+		int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+		for(long i = 0; i < mt_threads; i++)
+			if(pthread_create(&th[i], NULL, mt_worker, (void *)i)) fail("pthread_create");
+		for(int i = 0; i < mt_threads; i++)
+			pthread_join(th[i], NULL);
+		pthread_barrier_destroy(&mt_barrier);
+		sprintf(name, "mt_%d", mt_threads);
+		report(&r, name, start, reads, writes);
+	}
+}
+
+// Reads a comma separated list of thread counts for the mt workload
+static int parse_threads( char *list )
+{
+	mt_runs = 0;
+	for(char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+		int n = atoi(s);
+		if(n < 1 || n > MT_MAX || mt_runs == MT_RUNS) return 0;
+		thread_counts[mt_runs++] = n;
+	}
+	return mt_runs > 0;
+}
+
+// The transfers of a trace written by ds_trace (the rastrear command of
+// fat-sys), replayed on the disk file as fast as it takes them. Only the
+// total time is known, so the latency columns are 0.
+static void bench_replay()
+{
+	if(!trace) return;
+	run r;
+	setup(&r);
+	double start = now();
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	long n = ds_replay(r.disk, trace);
+	if(n < 0) fail(trace);
+	r.ops = n;
+	r.bytes = (long)(ds_reads(r.disk) - reads + ds_writes(r.disk) - writes) * BLOCK_SIZE;
+	report(&r, "replay", start, reads, writes);
+}
+
+// Mounts of an image holding one file, each after releasing the previous
+// mount; with -f, the FAT is loaded on demand
+static void bench_mount()
+{
+	run r;
+	setup(&r);
+	prepare(&r, "m", (1L << 20) * scale, 65536);
+	int mounts = 50 * scale;
+	double start = now(), t;
+	int reads = ds_reads(r.disk), writes = ds_writes(r.disk);
+	for(int i = 0; i < mounts; i++) {
+		fat_free(r.fs);
+		t = now();
+		r.fs = fat_new(r.disk);
+		if(!r.fs || fat_set_lazy(r.fs, fat_pages) || fat_mount(r.fs)) fail("montar");
+		record(&r, t, 0);
+	}
+	report(&r, "mount", start, reads, writes);
+}
+
+static void random_write() { bench_random(1); }
+static void random_read() { bench_random(0); }
+
+static const struct{
+	const char *name;
+	void (*fn)();
+} workloads[] = {
+	{ "create_delete", bench_create_delete },
+	{ "seq_write", bench_seq_write },
+	{ "seq_read", bench_seq_read },
+	{ "random_read", random_read },
+	{ "random_write", random_write },
+	{ "interleaved", bench_interleaved },
+	{ "mt", bench_mt },
+	{ "mount", bench_mount },
+	{ "replay", bench_replay },
+};
+#define N_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static int usage( const char *prog )
+{
+	fprintf(stderr, "uso: %s [-n blocos] [-b stdio|mmap|pio|direct] [-c blocos_cache] [-d] [-f blocos_fat] [-j threads[,threads...]] [-s escala] [-i imagem] [-r rastro] [carga...]\n", prog);
+	fprintf(stderr, "cargas:");
+	for(int i = 0; i < N_WORKLOADS; i++) fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+int main( int argc, char *argv[] )
+{
+	int opt;
+	while((opt = getopt(argc, argv, "hn:b:c:df:j:s:i:r:")) != -1) {
+		if(opt == 'n' && (blocks = atoi(optarg)) > 0) continue;
+		if(opt == 'c' && (cache = atoi(optarg)) >= 0) continue;
+		if(opt == 'f' && (fat_pages = atoi(optarg)) > 0) continue;
+		if(opt == 'j' && parse_threads(optarg)) continue;
+		if(opt == 's' && (scale = atoi(optarg)) > 0) continue;
+		if(opt == 'i') {
+			image = optarg;
+			continue;
+		}
+		if(opt == 'r') {
+			trace = optarg;
+			continue;
+		}
+		if(opt == 'd') {
+			delalloc = 1;
+			continue;
+		}
+		if(opt == 'b' && !strcmp(optarg, "stdio")) backend = DS_STDIO;
+		else if(opt == 'b' && !strcmp(optarg, "mmap")) backend = DS_MMAP;
+		else if(opt == 'b' && !strcmp(optarg, "pio")) backend = DS_PIO;
+		else if(opt == 'b' && !strcmp(optarg, "direct")) backend = DS_PIO | DS_DIRECT;
+		else return usage(argv[0]);
+		backend_name = optarg;
+	}
+	for(int i = optind; i < argc; i++) {
+		int found = 0;
+		for(int w = 0; w < N_WORKLOADS; w++) found |= !strcmp(argv[i], workloads[w].name);
+		if(!found) return usage(argv[0]);
+	}
+
+	printf("workload,backend,ops,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us,reads_per_op,writes_per_op,extents\n");
+	for(int w = 0; w < N_WORKLOADS; w++) {
+		int selected = optind == argc;
+		for(int i = optind; i < argc; i++) selected |= !strcmp(argv[i], workloads[w].name);
+		if(selected) workloads[w].fn();
+	}
+	return 0;
+}
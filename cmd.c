@@ -1,13 +1,22 @@
+#include "copy.h"
 #include "ds.h"
 #include "fat.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Function prototypes for file import/export between Linux and the simulated file system
-int cpout( char * os_path,  char *name );
-int cpin( char *name, char * os_path);
+int cpout( fat_fs *fs, char * os_path,  char *name );
+int cpin( fat_fs *fs, char *name, char * os_path);
+int cpdir( fat_fs *fs, char *os_dir );
+void stats( fat_fs *fs, ds_disk *disk );
+
+int chunk = COPY_CHUNK_DEFAULT; // Bytes per buffer of the copy ring, set with -t
+int delalloc = 0;               // 1 to buffer appends until flushed, set with -d
+int fat_pages = 0;              // FAT blocks kept in memory when loaded on demand, set with -f
 
 // Main function: command-line interface for interacting with the simulated FAT file system
 int main( int argc, char *argv[] )
@@ -17,20 +26,58 @@ int main( int argc, char *argv[] )
 	char arg1[1024];    // Buffer for first argument
 	char arg2[1024];    // Buffer for second argument
 	int result, args;   // Variables for command results and argument count
+	int opt;            // Current command-line option
+	ds_disk *disk;      // Simulated disk
+	fat_fs *fs;         // File system on that disk
+
+	disk = ds_new();
+	if(!disk) {
+		printf("falha: %s\n",strerror(errno));
+		return 1;
+	}
+
+	// Parse options: -c sets the number of blocks in the disk cache,
+	// -b selects the disk backend (stdio, mmap, pio or direct), -t the size
+	// in bytes of each buffer used by importar and exportar, -d turns on
+	// delayed allocation, -f loads the FAT on demand keeping that many of
+	// its blocks in memory
+	while((opt = getopt(argc, argv, "c:b:t:df:")) != -1) {
+		if(opt == 'c' && ds_cache(disk, atoi(optarg))) continue;
+		if(opt == 't' && (chunk = atoi(optarg)) > 0) continue;
+		if(opt == 'f' && (fat_pages = atoi(optarg)) > 0) continue;
+		if(opt == 'd') {
+			delalloc = 1;
+			continue;
+		}
+		if(opt == 'b' && !strcmp(optarg,"stdio") && ds_backend(disk, DS_STDIO)) continue;
+		if(opt == 'b' && !strcmp(optarg,"mmap") && ds_backend(disk, DS_MMAP)) continue;
+		if(opt == 'b' && !strcmp(optarg,"pio") && ds_backend(disk, DS_PIO)) continue;
+		if(opt == 'b' && !strcmp(optarg,"direct") && ds_backend(disk, DS_PIO|DS_DIRECT)) continue;
+		printf("uso: %s [-c blocos_cache] [-b stdio|mmap|pio|direct] [-t bytes_copia] [-d] [-f blocos_fat] <arquivo> <quantosblocos>\n",argv[0]);
+		return 1;
+	}
 
 	// Check for correct number of command-line arguments
-	if(argc!=3) {
-		printf("uso: %s <arquivo> <quantosblocos>\n",argv[0]);
+	if(argc-optind!=2) {
+		printf("uso: %s [-c blocos_cache] [-b stdio|mmap|pio|direct] [-t bytes_copia] [-d] [-f blocos_fat] <arquivo> <quantosblocos>\n",argv[0]);
 		return 1;
 	}
 
 	// Initialize disk simulation with the given file and number of blocks
-	if(!ds_init(argv[1],atoi(argv[2]))) {
-		printf("falha %s: %s\n",argv[1],strerror(errno));
+	if(!ds_init(disk, argv[optind],atoi(argv[optind+1]))) {
+		printf("falha %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	fs = fat_new(disk);
+	if(!fs) {
+		printf("falha: %s\n",strerror(errno));
 		return 1;
 	}
+	fat_set_delalloc(fs, delalloc);
+	fat_set_lazy(fs, fat_pages);
 
-	printf("simulacao de disco %s com %d blocos\n",argv[1],ds_size());
+	printf("simulacao de disco %s com %d blocos\n",argv[optind],ds_size(disk));
 
 	// Main command loop: prompt user for commands until "sair" is entered
 	while(1) {
@@ -51,7 +98,7 @@ int main( int argc, char *argv[] )
 		if(!strcmp(cmd,"formatar")) {
 			// Format the simulated disk
 			if(args==1) {
-				if(!fat_format()) {
+				if(!fat_format(fs)) {
 					printf("formatou\n");
 				} else {
 					printf("falhou na formatacao!\n");
@@ -62,7 +109,7 @@ int main( int argc, char *argv[] )
 		} else if(!(strcmp(cmd,"montar"))) {
 			// Mount the FAT file system
 			if(args==1) {
-				if(!fat_mount()) {
+				if(!fat_mount(fs)) {
 					printf("montagem ok\n");
 				} else {
 					printf("falha de montagem!\n");
@@ -73,16 +120,16 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"depurar")) {
 			// Debug: print file system state
 			if(args==1) {
-				fat_debug();
+				fat_debug(fs);
 			} else {
 				printf("uso: depurar\n");
 			}
 		} else if(!strcmp(cmd,"medir")) {
 			// Get file size
 			if(args==2) {
-				result = fat_getsize(arg1);
-				if(result>=0) {
-					printf("o arquivo %s mede %d\n",arg1,result);
+				long size = fat_getsize(fs, arg1);
+				if(size>=0) {
+					printf("o arquivo %s mede %ld\n",arg1,size);
 				} else {
 					printf("falha na medida!\n");
 				}
@@ -93,9 +140,9 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"criar")) {
 			// Create a new file
 			if(args==2) {
-				result = fat_create(arg1);
+				result = fat_create(fs, arg1);
 				if(result==0) {
-					printf("novo arquivo %s\n",arg1);
+					printf("novo arquivo %s (%d blocos de metadados escritos)\n",arg1,fat_meta_writes());
 				} else {
 					printf("falha ao criar arquivo!\n");
 				}
@@ -105,8 +152,8 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"deletar")) {
 			// Delete a file
 			if(args==2) {
-				if(!fat_delete(arg1)) {
-					printf("arquivo %s deletado\n",arg1);
+				if(!fat_delete(fs, arg1)) {
+					printf("arquivo %s deletado (%d blocos de metadados escritos)\n",arg1,fat_meta_writes());
 				} else {
 					printf("falha na delecao!\n");	
 				}
@@ -116,7 +163,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"ver")) {
 			// View file contents (output to stdout)
 			if(args==2) {
-				if(!cpout(arg1,"/dev/stdout")) {
+				if(!cpout(fs, arg1,"/dev/stdout")) {
 					printf("falha em ver arquivo!\n");
 				}
 			} else {
@@ -126,7 +173,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"importar")) {
 			// Import a file from Linux into the simulated file system
 			if(args==3) {
-				if(cpin(arg1,arg2)) {
+				if(cpin(fs, arg1,arg2)) {
 					printf("arquivo linux %s copiado para %s\n",arg1,arg2);
 				} else {
 					printf("falha ao copiar!\n");
@@ -135,10 +182,22 @@ int main( int argc, char *argv[] )
 				printf("uso: importar <nome no linux> <nome fat-sys>\n");
 			}
 
+		} else if(!strcmp(cmd,"importardir")) {
+			// Import every file of a Linux directory under the same names
+			if(args==2) {
+				if(cpdir(fs, arg1)) {
+					printf("diretorio linux %s copiado\n",arg1);
+				} else {
+					printf("falha ao copiar!\n");
+				}
+			} else {
+				printf("uso: importardir <diretorio no linux>\n");
+			}
+
 		} else if(!strcmp(cmd,"exportar")) {
 			// Export a file from the simulated file system to Linux
 			if(args==3) {
-				if(cpout(arg1,arg2)) {
+				if(cpout(fs, arg1,arg2)) {
 					printf("fat-sys %s copiado para arquivo %s\n", arg1,arg2);
 				} else {
 					printf("falha ao copiar!\n");
@@ -147,6 +206,67 @@ int main( int argc, char *argv[] )
 				printf("uso: exportar <nome fat-sys> <nome linux>\n");
 			}
 
+		} else if(!strcmp(cmd,"desfragmentar")) {
+			// Make every file contiguous and gather the free space at the end
+			if(args==1) {
+				result = fat_defrag(fs);
+				if(result>=0) {
+					printf("%d blocos movidos (%d blocos de metadados escritos)\n",result,fat_meta_writes());
+				} else {
+					printf("falha ao desfragmentar!\n");
+				}
+			} else {
+				printf("uso: desfragmentar\n");
+			}
+
+		} else if(!strcmp(cmd,"estatisticas")) {
+			// Print the disk counters and the latency of the fat_* calls
+			if(args==1) {
+				stats(fs, disk);
+			} else {
+				printf("uso: estatisticas\n");
+			}
+
+		} else if(!strcmp(cmd,"rastrear")) {
+			// Start or stop the trace of the disk transfers
+			if(args==2 && ds_trace(disk, arg1)) {
+				printf("rastreando as transferencias em %s\n",arg1);
+			} else if(args==1 && ds_trace(disk, NULL)) {
+				printf("rastreamento encerrado\n");
+			} else if(args<=2) {
+				printf("falha ao rastrear %s: %s\n",arg1,strerror(errno));
+			} else {
+				printf("uso: rastrear [arquivo]\n");
+			}
+
+		} else if(!strcmp(cmd,"sincronizar")) {
+			// Write the data still buffered in delayed allocation mode
+			if(args==1) {
+				if(!fat_flush(fs)) {
+					printf("sincronizado (%d blocos de metadados escritos)\n",fat_meta_writes());
+				} else {
+					printf("falha ao sincronizar!\n");
+				}
+			} else {
+				printf("uso: sincronizar\n");
+			}
+
+		} else if(!strcmp(cmd,"fragmentacao")) {
+			// Report how fragmented the files and the free space are
+			if(args==1) {
+				fat_frag frag;
+				if(!fat_fragmentation(fs, &frag)) {
+					printf("%d arquivos, %d blocos em %d extents (%.2f por arquivo), %d fragmentados\n",
+					       frag.files,frag.blocks,frag.extents,
+					       frag.files ? (double)frag.extents/frag.files : 0.0,frag.fragmented);
+					printf("espaco livre em %d trechos, o maior com %d blocos\n",frag.free_runs,frag.largest_free);
+				} else {
+					printf("falha ao medir fragmentacao!\n");
+				}
+			} else {
+				printf("uso: fragmentacao\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			// Print help message
 			printf("Comandos:\n");
@@ -157,7 +277,13 @@ int main( int argc, char *argv[] )
 			printf("    deletar <arquivo>\n");
 			printf("    ver     <arquivo>\n");
 			printf("    medir   <arquivo>\n");
+			printf("    fragmentacao\n");
+			printf("    desfragmentar\n");
+			printf("    sincronizar\n");
+			printf("    estatisticas\n");
+			printf("    rastrear [arquivo]\n");
 			printf("    importar <nome no linux> <nome fat-sys>\n");
+			printf("    importardir <diretorio no linux>\n");
 			printf("    exportar <nome fat-sys> <nome no linux>\n");
 			printf("    help\n");
 			printf("    sair\n");
@@ -173,74 +299,119 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("fechando o disco simulado\n");
-	ds_close();
+	fat_free(fs);
+	ds_free(disk);
 
 	return 0;
 }
 
 // Import a file from Linux into the simulated file system
-int cpin( char *name, char *op_path )
+int cpin( fat_fs *fs, char *name, char *op_path )
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	copy_stats st;
+	int file, result;
 
-	file = fopen(name,"r"); // Open Linux file for reading
-	if(!file) {
+	file = open(name,O_RDONLY); // Open Linux file for reading
+	if(file<0) {
 		printf("falha ao acessar %s: %s\n",name,strerror(errno));
 		return 0;
 	}
 
-	// Read from Linux file and write to simulated file system
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fat_write(op_path,buffer,result,offset);
-			if(actual<0) {
-				printf("ERRO: fat_write returnou codigo %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("ATENCAO: fat_write escreveu apenas %d bytes, em vez de %d bytes\n",actual,result);
-				break;
-			}
-		}
+	// A reader thread fills buffers from the Linux file while this thread
+	// writes them into the simulated file system
+	result = copy_in(fs,file,op_path,chunk,&st);
+	if(result<0)
+		printf("ERRO ao copiar para %s: %s\n",op_path,strerror(errno));
+
+	printf("copia de %ld bytes (%d blocos de metadados escritos)\n",st.bytes,st.meta);
+
+	close(file);
+	return result==0;
+}
+
+// Import every regular file of a Linux directory, creating or replacing
+// files of the same names in the simulated file system
+int cpdir( fat_fs *fs, char *os_dir )
+{
+	copy_stats st;
+
+	if(copy_dir_in(fs,os_dir,chunk,&st)<0 && !st.files && !st.failed) {
+		printf("falha ao acessar %s: %s\n",os_dir,strerror(errno));
+		return 0;
 	}
 
-	printf("copia de %d bytes\n",offset);
+	printf("%d arquivos, %ld bytes copiados (%d blocos de metadados escritos)\n",st.files,st.bytes,st.meta);
+	if(st.failed)
+		printf("ATENCAO: %d arquivos nao foram copiados por inteiro\n",st.failed);
+	return !st.failed;
+}
 
-	fclose(file);
-	return 1;
+// Upper bound, in microseconds, of the latency bucket holding the fraction
+// q of the calls
+static long percentile( const long *latency, long calls, double q )
+{
+	long seen = 0;
+	for(int b = 0; b < FAT_LAT_BUCKETS; b++) {
+		seen += latency[b];
+		if(seen >= q * calls) return 1L << b;
+	}
+	return 1L << (FAT_LAT_BUCKETS - 1);
+}
+
+// Print the disk counters, by class of block and access pattern, and the
+// latency of each fat_* call made so far
+void stats( fat_fs *fs, ds_disk *disk )
+{
+	static const char *classes[DS_CLASSES] = { "dados", "superbloco", "diretorio", "fat" };
+	ds_stats ds;
+	fat_stats st;
+
+	ds_get_stats(disk, &ds);
+	fat_get_stats(fs, &st);
+	printf("%ld blocos lidos, %ld escritos\n",ds.reads,ds.writes);
+	printf("cache: %ld acertos, %ld faltas; %ld blocos lidos antes (%ld usados)\n",
+	       ds.hits,ds.misses,ds.prefetched,ds.prefetch_hits);
+	printf("%-12s %10s %10s %10s %10s\n","blocos","leit.seq","leit.aleat","escr.seq","escr.aleat");
+	for(int c = 0; c < DS_CLASSES; c++)
+		printf("%-12s %10ld %10ld %10ld %10ld\n",classes[c],
+		       ds.blocks[c][0][0],ds.blocks[c][0][1],ds.blocks[c][1][0],ds.blocks[c][1][1]);
+
+	printf("%-12s %10s %10s %10s %10s\n","chamada","vezes","media_us","p50_us<=","p99_us<=");
+	for(int op = 0; op < FAT_OPS; op++) {
+		if(!st.calls[op]) continue;
+		printf("%-12s %10ld %10.1f %10ld %10ld\n",fat_op_name(op),st.calls[op],
+		       st.nanos[op] / 1000.0 / st.calls[op],
+		       percentile(st.latency[op],st.calls[op],0.5),
+		       percentile(st.latency[op],st.calls[op],0.99));
+	}
 }
 
 // Export a file from the simulated file system to Linux
-int cpout( char *os_path, char *name )
+int cpout( fat_fs *fs, char *os_path, char *name )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
-    if(strcmp(name,"/dev/stdout"))
-		file = fopen(name,"w"); // Open Linux file for writing
-	else
-		file = stdout;         // Or use stdout for "ver" command
-	if(!file) {
+	copy_stats st;
+	int file, result;
+
+	if(strcmp(name,"/dev/stdout")) {
+		file = open(name,O_WRONLY|O_CREAT|O_TRUNC,0666); // Open Linux file for writing
+	} else {
+		fflush(stdout);
+		file = STDOUT_FILENO;   // Or use stdout for "ver" command
+	}
+	if(file<0) {
 		printf("nao deu para abrir %s: %s\n",name,strerror(errno));
 		return 0;
 	}
 
-	// Read from simulated file system and write to Linux file
-	while(1) {
-		result = fat_read(os_path,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
-	}
+	// A reader thread fills buffers from the simulated file system (or hands
+	// out views of the mapped disk) while this thread writes them to Linux
+	result = copy_out(fs,os_path,file,chunk,&st);
+	if(result<0)
+		printf("falha ao copiar %s: %s\n",os_path,strerror(errno));
 
-	printf("copia de %d bytes\n",offset);
+	printf("copia de %ld bytes (janela de leitura antecipada: %d blocos)\n",st.bytes,st.window);
 
-	if(file != stdout)
-		fclose(file);
-	return 1;
+	if(file != STDOUT_FILENO)
+		close(file);
+	return result==0;
 }
@@ -0,0 +1,484 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "ds.h"
+#include "fat.h"
+
+// One buffer of the ring. The first slot of each file carries its name, so
+// the consumer knows when to switch files; a file always has at least one
+// slot, even when empty.
+typedef struct{
+	char *buff;          // Buffer owned by the slot
+	const char *data;    // Bytes to consume: buff, or a view of the mapped disk
+	int length;          // Number of bytes in data, -1 if the producer failed
+	int error;           // errno of the failure when length is -1
+	int first;           // 1 if this is the first slot of a file
+	char name[256];      // Name of the file, in the first slot
+	long size;           // Size of the host file in the first slot, -1 if unknown
+} slot;
+
+// Ring shared by the producer thread and the consumer. head and tail only
+// grow; slot i lives in ring[i % COPY_RING].
+typedef struct{
+	slot ring[COPY_RING];
+	int head;                  // Slots published by the producer
+	int tail;                  // Slots released by the consumer
+	int done;                  // 1 once the producer has published its last slot
+	int stop;                  // 1 if the consumer gave up
+	pthread_mutex_t lock;
+	pthread_cond_t filled;     // Signaled when head grows or done is set
+	pthread_cond_t drained;    // Signaled when tail grows or stop is set
+
+	int chunk;                 // Bytes per buffer
+	struct fat_fs *fs;
+	int fd;                    // Host file, or image handle for copy_out
+	char *name;                // Name sent with the file when fd is a host file
+	DIR *dir;                  // Host directory for copy_dir_in, NULL otherwise
+	long size;                 // Bytes to read from the image for copy_out
+	int window;                // Readahead window reached by copy_out
+} pipeline;
+
+static int pipe_init( pipeline *p, int chunk )
+{
+	memset(p, 0, sizeof(*p));
+	// Whole blocks let fat_pwrite skip reading the old contents
+	if(chunk < BLOCK_SIZE) chunk = BLOCK_SIZE;
+	p->chunk = chunk / BLOCK_SIZE * BLOCK_SIZE;
+	for(int i = 0; i < COPY_RING; i++) {
+		p->ring[i].buff = malloc(p->chunk);
+		if(!p->ring[i].buff) {
+			while(i--) free(p->ring[i].buff);
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->filled, NULL);
+	pthread_cond_init(&p->drained, NULL);
+	return 1;
+}
+
+static void pipe_destroy( pipeline *p )
+{
+	for(int i = 0; i < COPY_RING; i++) free(p->ring[i].buff);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->filled);
+	pthread_cond_destroy(&p->drained);
+}
+
+// Producer side: waits for a free slot. Returns NULL if the consumer gave up.
+static slot *pipe_acquire( pipeline *p )
+{
+	slot *s = NULL;
+	pthread_mutex_lock(&p->lock);
+	while(p->head - p->tail == COPY_RING && !p->stop)
+		pthread_cond_wait(&p->drained, &p->lock);
+	if(!p->stop) s = &p->ring[p->head % COPY_RING];
+	pthread_mutex_unlock(&p->lock);
+	if(s) {
+		s->first = 0;
+		s->error = 0;
+	}
+	return s;
+}
+
+static void pipe_publish( pipeline *p )
+{
+	pthread_mutex_lock(&p->lock);
+	p->head++;
+	pthread_cond_signal(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void pipe_finish( pipeline *p )
+{
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_signal(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Consumer side: waits for the next published slot. Returns NULL once the
+// producer is done and the ring is empty.
+static slot *pipe_next( pipeline *p )
+{
+	slot *s = NULL;
+	pthread_mutex_lock(&p->lock);
+	while(p->head == p->tail && !p->done)
+		pthread_cond_wait(&p->filled, &p->lock);
+	if(p->head != p->tail) s = &p->ring[p->tail % COPY_RING];
+	pthread_mutex_unlock(&p->lock);
+	return s;
+}
+
+static void pipe_release( pipeline *p )
+{
+	pthread_mutex_lock(&p->lock);
+	p->tail++;
+	pthread_cond_signal(&p->drained);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Lets the producer exit, then drops whatever it had already published
+static void pipe_stop( pipeline *p )
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->drained);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Reads until buff is full or the file ends; pipes and terminals may
+// return less than asked for.
+static int read_full( int fd, char *buff, int length )
+{
+	int total = 0;
+	while(total < length) {
+		ssize_t n = read(fd, buff + total, length - total);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		if(n == 0) break;
+		total += n;
+	}
+	return total;
+}
+
+static int write_full( int fd, const char *buff, int length )
+{
+	int total = 0;
+	while(total < length) {
+		ssize_t n = write(fd, buff + total, length - total);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		total += n;
+	}
+	return total;
+}
+
+// Sends one host file through the ring. Returns 0 if the consumer gave up.
+static int send_file( pipeline *p, int fd, const char *name )
+{
+	int first = 1, n;
+	do {
+		slot *s = pipe_acquire(p);
+		if(!s) return 0;
+		if(first) {
+			s->first = 1;
+			strncpy(s->name, name, sizeof(s->name) - 1);
+			s->name[sizeof(s->name) - 1] = 0;
+			struct stat st;
+			s->size = !fstat(fd, &st) && S_ISREG(st.st_mode) ? (long)st.st_size : -1;
+			first = 0;
+		}
+		n = read_full(fd, s->buff, p->chunk);
+		if(n < 0) s->error = errno;
+		s->data = s->buff;
+		s->length = n;
+		pipe_publish(p);
+	} while(n == p->chunk);
+	return 1;
+}
+
+// Producer of copy_in and copy_dir_in: reads the host file, or every
+// regular file of the host directory in the order readdir returns them.
+static void *read_host( void *arg )
+{
+	pipeline *p = arg;
+	if(!p->dir) {
+		send_file(p, p->fd, p->name);
+	} else {
+		struct dirent *e;
+		struct stat st;
+		int dfd = dirfd(p->dir);
+		while((e = readdir(p->dir))) {
+			if(fstatat(dfd, e->d_name, &st, 0) || !S_ISREG(st.st_mode)) continue;
+			int fd = openat(dfd, e->d_name, O_RDONLY);
+			if(fd < 0) {
+				// Still announce the file, so the consumer counts it as failed
+				slot *s = pipe_acquire(p);
+				if(!s) break;
+				s->first = 1;
+				strncpy(s->name, e->d_name, sizeof(s->name) - 1);
+				s->name[sizeof(s->name) - 1] = 0;
+				s->length = -1;
+				s->error = errno;
+				pipe_publish(p);
+				continue;
+			}
+			int more = send_file(p, fd, e->d_name);
+			close(fd);
+			if(!more) break;
+		}
+	}
+	pipe_finish(p);
+	return NULL;
+}
+
+// Creates name in the image, replacing the file of that name if there is
+// one. Returns 1, or 0 with errno set.
+static int create_file( struct fat_fs *fs, char *name, copy_stats *st )
+{
+	int result = fat_create(fs, name);
+	st->meta += fat_meta_writes();
+	if(result && errno == EEXIST) {
+		if(fat_delete(fs, name)) return 0;
+		st->meta += fat_meta_writes();
+		result = fat_create(fs, name);
+		st->meta += fat_meta_writes();
+	}
+	return !result;
+}
+
+// Writes length bytes at offset. fat_pwrite stores nothing when the whole
+// write does not fit, so that case is retried one block at a time to fill
+// the image as far as it goes. Returns the bytes written, or -1 with errno.
+static int write_chunk( struct fat_fs *fs, int fd, const char *data, int length, long offset, copy_stats *st )
+{
+	int n = fat_pwrite(fs, fd, data, length, offset);
+	st->meta += fat_meta_writes();
+	if(n >= 0 || errno != ENOSPC) return n;
+
+	int total = 0;
+	while(total < length) {
+		int piece = length - total < BLOCK_SIZE ? length - total : BLOCK_SIZE;
+		n = fat_pwrite(fs, fd, data + total, piece, offset + total);
+		st->meta += fat_meta_writes();
+		if(n <= 0) break;
+		total += n;
+	}
+	return total;
+}
+
+// Closes a file written by write_image, which writes the data the image
+// still buffers for it. Returns 1, or 0 with errno set.
+static int close_file( struct fat_fs *fs, int fd, copy_stats *st )
+{
+	int result = fat_close(fs, fd);
+	st->meta += fat_meta_writes();
+	return !result;
+}
+
+// Consumer of copy_in and copy_dir_in: writes the slots into the image.
+// With create, each file is created first, replacing a file of the same
+// name; otherwise the file must exist and is written from offset 0.
+static int write_image( pipeline *p, int create, copy_stats *st )
+{
+	slot *s;
+	int fd = -1, failed = 0, error = 0;
+	long offset = 0;
+	while((s = pipe_next(p))) {
+		if(s->first) {
+			if(fd >= 0 && close_file(p->fs, fd, st)) {
+				st->files++;
+			} else if(fd >= 0) {
+				error = errno;
+				st->failed++;
+				failed = 1;
+			}
+			fd = -1;
+			offset = 0;
+			if(s->length < 0) {
+				error = s->error;
+			} else if(create && !create_file(p->fs, s->name, st)) {
+				error = errno;
+			} else if((fd = fat_open(p->fs, s->name)) < 0) {
+				error = errno;
+			} else if(s->size > 0) {
+				// Room for the whole file in a row; without it, the writes
+				// still take what fits
+				fat_reserve(p->fs, fd, s->size);
+				st->meta += fat_meta_writes();
+			}
+			if(fd < 0) {
+				st->failed++;
+				failed = 1;
+			}
+		}
+		if(fd >= 0 && s->length < 0) {
+			error = s->error;
+			fat_close(p->fs, fd);
+			fd = -1;
+			st->failed++;
+			failed = 1;
+		} else if(fd >= 0 && s->length > 0) {
+			int n = write_chunk(p->fs, fd, s->data, s->length, offset, st);
+			if(n > 0) {
+				offset += n;
+				st->bytes += n;
+			}
+			if(n != s->length) {
+				error = n < 0 ? errno : ENOSPC;
+				fat_close(p->fs, fd);
+				fd = -1;
+				st->failed++;
+				failed = 1;
+			}
+		}
+		pipe_release(p);
+		// A single file is not worth reading to the end once it failed
+		if(failed && !p->dir) {
+			pipe_stop(p);
+			break;
+		}
+	}
+	if(fd >= 0 && close_file(p->fs, fd, st)) {
+		st->files++;
+	} else if(fd >= 0) {
+		error = errno;
+		st->failed++;
+		failed = 1;
+	}
+	if(failed) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static int run_in( pipeline *p, int create, copy_stats *st )
+{
+	pthread_t producer;
+	int result;
+	memset(st, 0, sizeof(*st));
+	if((result = pthread_create(&producer, NULL, read_host, p))) {
+		pipe_destroy(p);
+		errno = result;
+		return -1;
+	}
+	result = write_image(p, create, st);
+	int error = errno;
+	pthread_join(producer, NULL);
+	pipe_destroy(p);
+	errno = error;
+	return result;
+}
+
+// Copies the host file open in host_fd into the existing file name of the
+// image, from offset 0. Returns 0, or -1 with errno set.
+int copy_in( struct fat_fs *fs, int host_fd, char *name, int chunk, copy_stats *st )
+{
+	pipeline p;
+	if(!pipe_init(&p, chunk)) return -1;
+	p.fs = fs;
+	p.fd = host_fd;
+	p.name = name;
+	return run_in(&p, 0, st);
+}
+
+// Copies every regular file of host_dir into the image in one pass, under
+// the same name, creating or replacing each one. Files that cannot be read
+// or stored are counted in st->failed and skipped. Returns 0 if all files
+// were copied, or -1 with errno set from the last failure.
+int copy_dir_in( struct fat_fs *fs, const char *host_dir, int chunk, copy_stats *st )
+{
+	pipeline p;
+	DIR *dir = opendir(host_dir);
+	if(!dir) return -1;
+	if(!pipe_init(&p, chunk)) {
+		closedir(dir);
+		return -1;
+	}
+	p.fs = fs;
+	p.dir = dir;
+	int result = run_in(&p, 1, st);
+	int error = errno;
+	closedir(dir);
+	errno = error;
+	return result;
+}
+
+// Producer of copy_out: reads the image file up to size, handing out views
+// of the mapped disk instead of copies when the backend allows it. Views
+// are no longer asked for once the backend turns the first one down.
+static void *read_image( void *arg )
+{
+	pipeline *p = arg;
+	long offset = 0;
+	int views = 1;
+	while(offset < p->size) {
+		slot *s = pipe_acquire(p);
+		if(!s) break;
+		const char *view;
+		int n = views ? fat_pread_view(p->fs, p->fd, offset, &view) : 0;
+		if(n < 0 && errno == ENOTSUP) views = 0;
+		if(n > 0) {
+			s->data = view;
+		} else {
+			n = fat_pread(p->fs, p->fd, s->buff, p->chunk, offset);
+			s->data = s->buff;
+		}
+		if(n <= 0) {
+			s->error = n < 0 ? errno : EIO;
+			n = -1;
+		}
+		s->length = n;
+		pipe_publish(p);
+		if(n < 0) break;
+		offset += n;
+	}
+	p->window = fat_readahead(p->fs, p->fd);
+	pipe_finish(p);
+	return NULL;
+}
+
+// Copies the file name of the image into the host file open in host_fd.
+// Returns 0, or -1 with errno set.
+int copy_out( struct fat_fs *fs, char *name, int host_fd, int chunk, copy_stats *st )
+{
+	pipeline p;
+	pthread_t producer;
+	slot *s;
+	int result = 0, error = 0;
+
+	memset(st, 0, sizeof(*st));
+	int fd = fat_open(fs, name);
+	if(fd < 0) return -1;
+	if(!pipe_init(&p, chunk)) {
+		fat_close(fs, fd);
+		return -1;
+	}
+	p.fs = fs;
+	p.fd = fd;
+	p.size = fat_getsize(fs, name);
+	if((error = pthread_create(&producer, NULL, read_image, &p))) {
+		pipe_destroy(&p);
+		fat_close(fs, fd);
+		errno = error;
+		return -1;
+	}
+
+	while((s = pipe_next(&p))) {
+		if(s->length < 0) {
+			error = s->error;
+			result = -1;
+		} else if(write_full(host_fd, s->data, s->length) < 0) {
+			error = errno;
+			result = -1;
+			pipe_stop(&p);
+		} else {
+			st->bytes += s->length;
+		}
+		pipe_release(&p);
+		if(result) break;
+	}
+	pipe_stop(&p);
+	pthread_join(producer, NULL);
+	st->window = p.window;
+	pipe_destroy(&p);
+	fat_close(fs, fd);
+
+	if(result) {
+		st->failed = 1;
+		errno = error;
+		return -1;
+	}
+	st->files = 1;
+	return 0;
+}
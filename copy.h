@@ -0,0 +1,20 @@
+// Streaming copies between host files and an image. A producer thread fills
+// a ring of COPY_RING buffers while the calling thread drains it, so host
+// I/O and image I/O overlap.
+
+#define COPY_RING 4                 // Buffers in the ring
+#define COPY_CHUNK_DEFAULT (1<<20)  // Default size of each buffer, in bytes
+
+struct fat_fs;
+
+typedef struct{
+	int files;    // Files copied in full
+	int failed;   // Files skipped or copied in part
+	long bytes;   // Bytes copied
+	int meta;     // Metadata blocks written
+	int window;   // Readahead window at the end of copy_out, in blocks
+} copy_stats;
+
+int copy_in( struct fat_fs *fs, int host_fd, char *name, int chunk, copy_stats *st );
+int copy_out( struct fat_fs *fs, char *name, int host_fd, int chunk, copy_stats *st );
+int copy_dir_in( struct fat_fs *fs, const char *host_dir, int chunk, copy_stats *st );
@@ -1,48 +1,867 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#undef BLOCK_SIZE // linux/fs.h, included by linux/io_uring.h, has its own
 #include "ds.h"
 
-// Global variables to keep track of disk state and statistics
-static int number_blocks=0;    // Total number of blocks in the disk
-static int number_reads=0;     // Number of read operations performed
-static int number_writes=0;    // Number of write operations performed
-static FILE *disk;             // File pointer simulating the disk
+#define DS_TRACE_BUFFER 1024 // Trace records written to the file at a time
+
+// Block cache entry. Entries are kept in a doubly linked list ordered from
+// most recently used (head) to least recently used (tail), and in a hash
+// table indexed by block number.
+typedef struct cache_entry {
+	int number;                  // Block number held by this entry, -1 if empty
+	int dirty;                   // 1 if the data was modified and not yet written
+	int loading;                 // 1 while an asynchronous prefetch fills data
+	int prefetched;              // 1 if read ahead by ds_prefetch and not requested yet
+	struct cache_entry *prev;    // Previous entry in the LRU list (more recent)
+	struct cache_entry *next;    // Next entry in the LRU list (less recent)
+	struct cache_entry *hnext;   // Next entry in the same hash bucket
+	char *data;                  // Cached block contents (block aligned)
+} cache_entry;
+
+// Class of a range of blocks, or of a single block, set with ds_set_class
+#define DS_CLASS_RANGES 8 // Ranges kept; setting one more drops the oldest
+typedef struct{
+	int number;                  // First block
+	int count;                   // Number of blocks
+	int class;                   // DS_CLASS_*
+} class_range;
+
+// Asynchronous requests. With DS_PIO they run on io_uring when the kernel
+// supports it and on a pool of worker threads otherwise; the other backends
+// complete them at submission.
+typedef struct{
+	int write;                   // 1 for a write, 0 for a read
+	int number;                  // First block number
+	int count;                   // Number of consecutive blocks
+	char *buff;                  // Caller's buffer
+} request;
+
+// State of one simulated disk: the file, its cache and its asynchronous
+// requests.
+// lock protects the cache and the asynchronous request state, so the
+// block functions may be called from several threads; ds_init, ds_cache,
+// ds_backend and ds_close may not run concurrently with them.
+struct ds_disk {
+	pthread_mutex_t lock;
+	int number_blocks;      // Total number of blocks in the disk
+	int number_reads;       // Number of read operations performed
+	int number_writes;      // Number of write operations performed
+	int number_hits;        // Number of block requests served by the cache
+	int number_misses;      // Number of block requests that missed the cache
+	int number_prefetched;  // Number of blocks read ahead into the cache
+	int number_prefetch_hits; // Number of prefetched blocks requested afterwards
+	long class_blocks[DS_CLASSES][2][2]; // Blocks transferred, as in ds_stats
+	int next_block;         // Block after the last transfer, to tell sequential from random
+
+	// Classes of blocks: a few ranges, the most recently set first, and
+	// the blocks set one at a time (the scattered directory blocks), sorted
+	// by number, which take precedence. Other blocks are DS_CLASS_DATA.
+	pthread_mutex_t class_lock;
+	class_range class_ranges[DS_CLASS_RANGES];
+	int n_class_ranges;
+	class_range *class_singles;   // count is always 1
+	int n_class_singles;
+	int class_singles_capacity;
+	FILE *disk;             // File simulating the disk (DS_STDIO, DS_MMAP), read with pread/pwrite
+	int disk_fd;            // Descriptor of the disk file, -1 if closed
+	int backend;            // How the disk file is accessed
+	int direct;             // 1 if the disk file was opened with O_DIRECT
+	char *map;              // Mapping of the whole disk file (DS_MMAP)
+	char *bounce;           // Aligned block for unaligned O_DIRECT transfers
+
+	int cache_capacity;           // Maximum number of cached blocks
+	cache_entry *cache_entries;   // Storage for all cache entries
+	char *cache_data;             // Block storage for all cache entries
+	cache_entry **cache_table;    // Hash table of cached blocks
+	int cache_buckets;            // Number of buckets in cache_table
+	cache_entry *lru_head;        // Most recently used entry
+	cache_entry *lru_tail;        // Least recently used entry
+
+	int async_pending;      // Requests submitted since the last ds_wait
+	cache_entry *loading[DS_QUEUE_DEPTH]; // Entries filled by pending prefetches
+	int n_loading;                        // Number of entries in loading
+
+	int ring_fd;                           // io_uring instance, -1 if unused
+	void *sq_ring, *cq_ring;               // Submission and completion rings
+	size_t sq_ring_size, cq_ring_size;     // Size of each ring mapping
+	struct io_uring_sqe *sqes;             // Submission queue entries
+	size_t sqes_size;                      // Size of the sqes mapping
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	int ring_unsubmitted;                  // Entries queued but not yet entered
+	struct iovec ring_iov[DS_QUEUE_DEPTH]; // Transfer of each in-flight slot
+	request ring_req[DS_QUEUE_DEPTH];      // Request of each in-flight slot
+	char *ring_bounce;                     // Aligned blocks, one per slot (O_DIRECT)
+
+	pthread_t pool_threads[DS_THREADS];    // Worker threads, if started
+	int pool_started;                      // Number of workers running
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_work;              // New request or stop
+	pthread_cond_t pool_done;              // Request finished
+	request pool_queue[DS_QUEUE_DEPTH];    // Submitted requests
+	int pool_next;                         // Next request to be taken by a worker
+	int pool_count;                        // Number of requests in pool_queue
+	int pool_finished;                     // Number of requests completed
+	int pool_stop;                         // 1 when the workers must exit
+
+	pthread_mutex_t trace_lock;            // Protects the trace state
+	FILE *trace;                           // Trace file, NULL when not tracing
+	uint64_t trace_start;                  // Time the trace started, in nanoseconds
+	int trace_count;                       // Records in trace_buf
+	ds_trace_record trace_buf[DS_TRACE_BUFFER]; // Records not written yet
+};
+
+// Creates a disk with the default backend and cache size, to be set up
+// with ds_backend and ds_cache and opened with ds_init
+ds_disk *ds_new()
+{
+	ds_disk *d = calloc(1, sizeof(ds_disk));
+	if(!d) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_mutex_init(&d->pool_lock, NULL);
+	pthread_cond_init(&d->pool_work, NULL);
+	pthread_cond_init(&d->pool_done, NULL);
+	pthread_mutex_init(&d->trace_lock, NULL);
+	pthread_mutex_init(&d->class_lock, NULL);
+	d->disk_fd = -1;
+	d->ring_fd = -1;
+	d->backend = DS_STDIO;
+	d->cache_capacity = DS_CACHE_DEFAULT;
+	return d;
+}
+
+// Releases a disk created by ds_new, closing it first if it is open
+void ds_free( ds_disk *d )
+{
+	if(!d) return;
+	if(d->disk_fd >= 0) ds_close(d);
+	pthread_mutex_destroy(&d->lock);
+	pthread_mutex_destroy(&d->pool_lock);
+	pthread_cond_destroy(&d->pool_work);
+	pthread_cond_destroy(&d->pool_done);
+	pthread_mutex_destroy(&d->trace_lock);
+	pthread_mutex_destroy(&d->class_lock);
+	free(d);
+}
 
 // Returns the total number of blocks in the disk
-int ds_size()
+int ds_size( ds_disk *d )
+{
+	return d->number_blocks;
+}
+
+// Returns the number of blocks read from the disk file since ds_init
+int ds_reads( ds_disk *d )
+{
+	return __atomic_load_n(&d->number_reads, __ATOMIC_RELAXED);
+}
+
+// Returns the number of blocks written to the disk file since ds_init
+int ds_writes( ds_disk *d )
+{
+	return __atomic_load_n(&d->number_writes, __ATOMIC_RELAXED);
+}
+
+// Stops the simulation after a failed disk access
+static void fail()
+{
+	printf("disk simulation failed\n");
+	perror("ds");
+	exit(1); // Exit on failure
+}
+
+static uint64_t clock_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Writes the trace records kept in memory to the trace file. Called with
+// trace_lock held.
+static void trace_write( ds_disk *d )
+{
+	if(d->trace_count && fwrite(d->trace_buf, sizeof(ds_trace_record), d->trace_count, d->trace) != (size_t)d->trace_count)
+		perror("ds_trace");
+	d->trace_count = 0;
+}
+
+// Position of the first single block numbered number or higher, with
+// class_lock held
+static int single_find( ds_disk *d, int number )
+{
+	int lo = 0, hi = d->n_class_singles;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(d->class_singles[mid].number < number) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Returns the class of a block, with class_lock held
+static int class_of( ds_disk *d, int number )
+{
+	int i = single_find(d, number);
+	if(i < d->n_class_singles && d->class_singles[i].number == number) return d->class_singles[i].class;
+	for(i = 0; i < d->n_class_ranges; i++) {
+		class_range *c = &d->class_ranges[i];
+		if(number >= c->number && number < c->number + c->count) return c->class;
+	}
+	return DS_CLASS_DATA;
+}
+
+// Counts a transfer of count consecutive blocks from number to or from the
+// disk file: in the totals, by class of block and access pattern, and in
+// the trace when one is on
+static void account( ds_disk *d, int write, int number, int count )
+{
+	long per_class[DS_CLASSES] = {0};
+	if(write) __atomic_add_fetch(&d->number_writes, count, __ATOMIC_RELAXED);
+	else __atomic_add_fetch(&d->number_reads, count, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&d->class_lock);
+	int first = class_of(d, number);
+	for(int i = 0; i < count; i++)
+		per_class[class_of(d, number + i)]++;
+	pthread_mutex_unlock(&d->class_lock);
+	// So o primeiro bloco de uma transferencia pode ser aleatorio
+	if(__atomic_exchange_n(&d->next_block, number + count, __ATOMIC_RELAXED) != number) {
+		per_class[first]--;
+		__atomic_add_fetch(&d->class_blocks[first][write][1], 1, __ATOMIC_RELAXED);
+	}
+	for(int c = 0; c < DS_CLASSES; c++)
+		if(per_class[c]) __atomic_add_fetch(&d->class_blocks[c][write][0], per_class[c], __ATOMIC_RELAXED);
+
+	if(!__atomic_load_n(&d->trace, __ATOMIC_RELAXED)) return;
+	pthread_mutex_lock(&d->trace_lock);
+	if(d->trace) {
+		ds_trace_record *r = &d->trace_buf[d->trace_count++];
+		memset(r, 0, sizeof(*r));
+		r->time = clock_ns() - d->trace_start;
+		r->number = number;
+		r->count = count;
+		r->write = write;
+		r->class = first;
+		if(d->trace_count == DS_TRACE_BUFFER) trace_write(d);
+	}
+	pthread_mutex_unlock(&d->trace_lock);
+}
+
+// Transfers consecutive blocks with a single pread/pwrite. With O_DIRECT,
+// buffers that are not block aligned go one block at a time through the
+// given aligned bounce block.
+static int pio_transfer( ds_disk *d, int write, int number, int count, char *buff, char *aligned )
+{
+	off_t offset = (off_t)number*BLOCK_SIZE;
+	size_t size = (size_t)count*BLOCK_SIZE;
+	ssize_t x;
+
+	if(d->direct && ((uintptr_t)buff % BLOCK_SIZE)) {
+		for(int i = 0; i < count; i++) {
+			char *block = buff + (size_t)i*BLOCK_SIZE;
+			if(write) memcpy(aligned, block, BLOCK_SIZE);
+			if(write) x = pwrite(d->disk_fd, aligned, BLOCK_SIZE, offset + (off_t)i*BLOCK_SIZE);
+			else x = pread(d->disk_fd, aligned, BLOCK_SIZE, offset + (off_t)i*BLOCK_SIZE);
+			if(x != BLOCK_SIZE) return 0;
+			if(!write) memcpy(block, aligned, BLOCK_SIZE);
+		}
+		return 1;
+	}
+	if(write) x = pwrite(d->disk_fd, buff, size, offset);
+	else x = pread(d->disk_fd, buff, size, offset);
+	return x == (ssize_t)size;
+}
+
+// Transfers consecutive blocks straight to or from the disk file. Positional
+// I/O keeps no shared file position, so threads may call this concurrently;
+// the O_DIRECT bounce block is only used with d->lock held.
+static void disk_transfer( ds_disk *d, int write, int number, int count, char *buff )
+{
+	if(d->map) {
+		char *block = d->map + (size_t)number*BLOCK_SIZE;
+		if(!write) memcpy(buff, block, (size_t)count*BLOCK_SIZE);
+		else if(block != buff) memcpy(block, buff, (size_t)count*BLOCK_SIZE); // Skip in-place updates
+	} else {
+		if(!pio_transfer(d, write, number, count, buff, d->bounce)) fail();
+	}
+	account(d, write, number, count); // Count it if successful
+}
+
+// Reads a block straight from the disk file
+static void disk_read( ds_disk *d, int number, char *buff )
+{
+	disk_transfer(d, 0, number, 1, buff);
+}
+
+// Writes a block straight to the disk file
+static void disk_write( ds_disk *d, int number, const char *buff )
+{
+	disk_transfer(d, 1, number, 1, (char *)buff);
+}
+
+// Takes a snapshot of the counters of a disk
+void ds_get_stats( ds_disk *d, ds_stats *st )
+{
+	st->reads = __atomic_load_n(&d->number_reads, __ATOMIC_RELAXED);
+	st->writes = __atomic_load_n(&d->number_writes, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&d->lock);
+	st->hits = d->number_hits;
+	st->misses = d->number_misses;
+	st->prefetched = d->number_prefetched;
+	st->prefetch_hits = d->number_prefetch_hits;
+	pthread_mutex_unlock(&d->lock);
+	for(int c = 0; c < DS_CLASSES; c++)
+		for(int w = 0; w < 2; w++)
+			for(int r = 0; r < 2; r++)
+				st->blocks[c][w][r] = __atomic_load_n(&d->class_blocks[c][w][r], __ATOMIC_RELAXED);
+}
+
+// Sets the class of count blocks from number, for ds_get_stats and the
+// trace. A single block is kept apart from the ranges, so memory grows with
+// the blocks set one at a time, not with the disk.
+void ds_set_class( ds_disk *d, int number, int count, int class )
+{
+	if(number < 0 || count < 1 || (long)number + count > d->number_blocks) return;
+	pthread_mutex_lock(&d->class_lock);
+	// the single blocks in the way are dropped
+	int first = single_find(d, number), last = single_find(d, number + count);
+	memmove(d->class_singles + first, d->class_singles + last,
+	        (d->n_class_singles - last) * sizeof(class_range));
+	d->n_class_singles -= last - first;
+
+	if(count == 1) {
+		// a block the ranges already give its class needs no entry
+		if(class_of(d, number) != class) {
+			int n = d->n_class_singles;
+			if(n == d->class_singles_capacity) {
+				int capacity = n ? 2 * n : 16;
+				class_range *singles = realloc(d->class_singles, capacity * sizeof(class_range));
+				if(!singles) {
+					pthread_mutex_unlock(&d->class_lock);
+					return;
+				}
+				d->class_singles = singles;
+				d->class_singles_capacity = capacity;
+			}
+			memmove(d->class_singles + first + 1, d->class_singles + first, (n - first) * sizeof(class_range));
+			d->class_singles[first] = (class_range){ number, 1, class };
+			d->n_class_singles = n + 1;
+		}
+	} else {
+		// ranges inside the new one no longer matter, and the oldest goes
+		// if there is no room
+		int kept = 0;
+		for(int i = 0; i < d->n_class_ranges && kept < DS_CLASS_RANGES - 1; i++) {
+			class_range *c = &d->class_ranges[i];
+			if(c->number >= number && c->number + c->count <= number + count) continue;
+			d->class_ranges[kept++] = *c;
+		}
+		memmove(d->class_ranges + 1, d->class_ranges, kept * sizeof(class_range));
+		d->class_ranges[0] = (class_range){ number, count, class };
+		d->n_class_ranges = kept + 1;
+	}
+	pthread_mutex_unlock(&d->class_lock);
+}
+
+// Starts writing a trace of every transfer to or from the disk file to
+// filename, replacing a trace in progress, or stops tracing if filename is
+// NULL. Records are kept in memory and written DS_TRACE_BUFFER at a time.
+// Returns 1 on success, 0 with errno set otherwise.
+int ds_trace( ds_disk *d, const char *filename )
+{
+	FILE *trace = NULL;
+	if(filename && !(trace = fopen(filename, "wb"))) return 0;
+	pthread_mutex_lock(&d->trace_lock);
+	if(d->trace) {
+		trace_write(d);
+		fclose(d->trace);
+	}
+	d->trace_start = clock_ns();
+	__atomic_store_n(&d->trace, trace, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&d->trace_lock);
+	return 1;
+}
+
+// Repeats the transfers of a trace written by ds_trace on the disk, straight
+// to and from the disk file and as fast as possible. Writes store zeros, so
+// the disk should be a scratch one. Returns the number of transfers
+// replayed, or -1 with errno set.
+long ds_replay( ds_disk *d, const char *filename )
+{
+	FILE *trace = fopen(filename, "rb");
+	if(!trace) return -1;
+	ds_trace_record r;
+	char *buff = NULL;
+	int capacity = 0;
+	long replayed = 0;
+	while(fread(&r, sizeof(r), 1, trace) == 1) {
+		if(r.number < 0 || r.count < 1 || (long)r.number + r.count > d->number_blocks) {
+			errno = EINVAL;
+			replayed = -1;
+			break;
+		}
+		if(r.count > capacity) {
+			free(buff);
+			capacity = r.count;
+			if(posix_memalign((void **)&buff, BLOCK_SIZE, (size_t)capacity*BLOCK_SIZE)) {
+				errno = ENOMEM;
+				buff = NULL;
+				replayed = -1;
+				break;
+			}
+			memset(buff, 0, (size_t)capacity*BLOCK_SIZE);
+		}
+		pthread_mutex_lock(&d->lock); // O_DIRECT bounce block
+		disk_transfer(d, r.write, r.number, r.count, buff);
+		pthread_mutex_unlock(&d->lock);
+		replayed++;
+	}
+	free(buff);
+	fclose(trace);
+	return replayed;
+}
+
+static void wait_locked( ds_disk *d );
+
+// Unlinks an entry from the LRU list
+static void lru_remove( ds_disk *d, cache_entry *e )
+{
+	if(e->prev) e->prev->next = e->next; else d->lru_head = e->next;
+	if(e->next) e->next->prev = e->prev; else d->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+// Puts an entry at the head of the LRU list (most recently used)
+static void lru_push( ds_disk *d, cache_entry *e )
+{
+	e->prev = NULL;
+	e->next = d->lru_head;
+	if(d->lru_head) d->lru_head->prev = e;
+	d->lru_head = e;
+	if(!d->lru_tail) d->lru_tail = e;
+}
+
+// Finds a cached block, or NULL if it is not in the cache
+static cache_entry *cache_lookup( ds_disk *d, int number )
+{
+	if(!d->cache_buckets) return NULL;
+	cache_entry *e = d->cache_table[number % d->cache_buckets];
+	while(e && e->number != number) e = e->hnext;
+	return e;
+}
+
+// Removes an entry from its hash bucket
+static void cache_unhash( ds_disk *d, cache_entry *e )
+{
+	cache_entry **p = &d->cache_table[e->number % d->cache_buckets];
+	while(*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+	e->hnext = NULL;
+}
+
+// Takes the least recently used entry, writing it back if dirty, and
+// rebinds it to the given block number
+static cache_entry *cache_evict( ds_disk *d, int number )
+{
+	cache_entry *e = d->lru_tail;
+	if(e->loading) wait_locked(d);
+	if(e->number >= 0) {
+		if(e->dirty) disk_write(d, e->number, e->data);
+		cache_unhash(d, e);
+	}
+	e->number = number;
+	e->dirty = 0;
+	e->prefetched = 0;
+	e->hnext = d->cache_table[number % d->cache_buckets];
+	d->cache_table[number % d->cache_buckets] = e;
+	return e;
+}
+
+// Releases the cache memory, writing back dirty blocks first
+static void cache_destroy( ds_disk *d )
+{
+	if(d->disk_fd >= 0) ds_flush(d);
+	free(d->cache_entries);
+	free(d->cache_data);
+	free(d->cache_table);
+	d->cache_entries = NULL;
+	d->cache_data = NULL;
+	d->cache_table = NULL;
+	d->cache_buckets = 0;
+	d->lru_head = d->lru_tail = NULL;
+}
+
+// Allocates the cache with the configured capacity
+static int cache_create( ds_disk *d )
+{
+	if(d->cache_capacity <= 0) return 1; // Cache disabled
+
+	d->cache_buckets = 2 * d->cache_capacity + 1;
+	d->cache_entries = malloc(sizeof(cache_entry) * d->cache_capacity);
+	d->cache_table = calloc(d->cache_buckets, sizeof(cache_entry *));
+	if(posix_memalign((void **)&d->cache_data, BLOCK_SIZE, (size_t)d->cache_capacity * BLOCK_SIZE))
+		d->cache_data = NULL;
+	if(!d->cache_entries || !d->cache_table || !d->cache_data) {
+		free(d->cache_entries);
+		free(d->cache_data);
+		free(d->cache_table);
+		d->cache_entries = NULL;
+		d->cache_data = NULL;
+		d->cache_table = NULL;
+		d->cache_buckets = 0;
+		return 0;
+	}
+
+	for(int i = 0; i < d->cache_capacity; i++) {
+		d->cache_entries[i].number = -1;
+		d->cache_entries[i].dirty = 0;
+		d->cache_entries[i].loading = 0;
+		d->cache_entries[i].prefetched = 0;
+		d->cache_entries[i].hnext = NULL;
+		d->cache_entries[i].prev = d->cache_entries[i].next = NULL;
+		d->cache_entries[i].data = d->cache_data + (size_t)i * BLOCK_SIZE;
+		lru_push(d, &d->cache_entries[i]);
+	}
+	return 1;
+}
+
+// Sets how many blocks the cache may hold (0 disables it).
+// May be called before or after ds_init; dirty blocks are written back first.
+int ds_cache( ds_disk *d, int blocks )
+{
+	if(blocks < 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	cache_destroy(d);
+	d->cache_capacity = blocks;
+	if(d->disk_fd < 0 || d->map) return 1; // Cache is created by ds_init
+	if(!cache_create(d)) {
+		errno = ENOMEM;
+		return 0;
+	}
+	return 1;
+}
+
+// Sets up an io_uring instance for asynchronous requests.
+// Returns 0 if the kernel does not provide it.
+static int ring_setup( ds_disk *d )
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	d->ring_fd = syscall(__NR_io_uring_setup, DS_QUEUE_DEPTH, &p);
+	if(d->ring_fd < 0) {
+		d->ring_fd = -1;
+		return 0;
+	}
+
+	d->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	d->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(d->cq_ring_size > d->sq_ring_size) d->sq_ring_size = d->cq_ring_size;
+		d->cq_ring_size = d->sq_ring_size;
+	}
+	d->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	d->sq_ring = mmap(NULL, d->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring_fd, IORING_OFF_SQ_RING);
+	d->cq_ring = mmap(NULL, d->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring_fd, IORING_OFF_CQ_RING);
+	d->sqes = mmap(NULL, d->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring_fd, IORING_OFF_SQES);
+	if(d->direct && posix_memalign((void **)&d->ring_bounce, BLOCK_SIZE, (size_t)DS_QUEUE_DEPTH * BLOCK_SIZE))
+		d->ring_bounce = NULL;
+	if(d->sq_ring == MAP_FAILED || d->cq_ring == MAP_FAILED || d->sqes == MAP_FAILED || (d->direct && !d->ring_bounce)) {
+		if(d->sq_ring != MAP_FAILED) munmap(d->sq_ring, d->sq_ring_size);
+		if(d->cq_ring != MAP_FAILED) munmap(d->cq_ring, d->cq_ring_size);
+		if(d->sqes != MAP_FAILED) munmap(d->sqes, d->sqes_size);
+		free(d->ring_bounce);
+		d->ring_bounce = NULL;
+		close(d->ring_fd);
+		d->ring_fd = -1;
+		return 0;
+	}
+
+	d->sq_tail = (unsigned *)((char *)d->sq_ring + p.sq_off.tail);
+	d->sq_mask = (unsigned *)((char *)d->sq_ring + p.sq_off.ring_mask);
+	d->sq_array = (unsigned *)((char *)d->sq_ring + p.sq_off.array);
+	d->cq_head = (unsigned *)((char *)d->cq_ring + p.cq_off.head);
+	d->cq_tail = (unsigned *)((char *)d->cq_ring + p.cq_off.tail);
+	d->cq_mask = (unsigned *)((char *)d->cq_ring + p.cq_off.ring_mask);
+	d->cqes = (struct io_uring_cqe *)((char *)d->cq_ring + p.cq_off.cqes);
+	d->ring_unsubmitted = 0;
+	return 1;
+}
+
+// Releases the io_uring instance
+static void ring_destroy( ds_disk *d )
+{
+	munmap(d->sq_ring, d->sq_ring_size);
+	munmap(d->cq_ring, d->cq_ring_size);
+	munmap(d->sqes, d->sqes_size);
+	free(d->ring_bounce);
+	d->ring_bounce = NULL;
+	close(d->ring_fd);
+	d->ring_fd = -1;
+}
+
+// Queues a request in slot `slot` of the submission ring
+static void ring_queue( ds_disk *d, int slot, request r )
+{
+	unsigned tail = *d->sq_tail;
+	unsigned index = tail & *d->sq_mask;
+	struct io_uring_sqe *sqe = &d->sqes[index];
+	char *data = r.buff;
+
+	// Unaligned O_DIRECT requests are split into single blocks before this
+	if(d->direct && ((uintptr_t)r.buff % BLOCK_SIZE)) {
+		data = d->ring_bounce + (size_t)slot * BLOCK_SIZE;
+		if(r.write) memcpy(data, r.buff, BLOCK_SIZE);
+	}
+	d->ring_req[slot] = r;
+	d->ring_iov[slot].iov_base = data;
+	d->ring_iov[slot].iov_len = (size_t)r.count * BLOCK_SIZE;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = d->disk_fd;
+	sqe->off = (uint64_t)r.number * BLOCK_SIZE;
+	sqe->addr = (uint64_t)(uintptr_t)&d->ring_iov[slot];
+	sqe->len = 1;
+	sqe->user_data = slot;
+	d->sq_array[index] = index;
+	__atomic_store_n(d->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	d->ring_unsubmitted++;
+}
+
+// Submits the queued entries and reaps completions until every request
+// submitted since the last wait has finished
+static void ring_wait( ds_disk *d )
+{
+	int completed = 0;
+	while(completed < d->async_pending) {
+		int ret = syscall(__NR_io_uring_enter, d->ring_fd, d->ring_unsubmitted,
+		                  d->async_pending - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0) {
+			if(errno == EINTR) continue;
+			fail();
+		}
+		d->ring_unsubmitted -= ret;
+
+		unsigned head = *d->cq_head;
+		while(head != __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &d->cqes[head & *d->cq_mask];
+			int slot = cqe->user_data;
+			if(cqe->res != (int)d->ring_iov[slot].iov_len) {
+				if(cqe->res < 0) errno = -cqe->res;
+				fail();
+			}
+			if(!d->ring_req[slot].write && d->ring_iov[slot].iov_base != d->ring_req[slot].buff)
+				memcpy(d->ring_req[slot].buff, d->ring_iov[slot].iov_base, d->ring_iov[slot].iov_len);
+			head++;
+			completed++;
+		}
+		__atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+// Hands the queued entries to the kernel without waiting for them, so
+// they start at once; ring_wait reaps them later
+static void ring_submit( ds_disk *d )
+{
+	while(d->ring_unsubmitted) {
+		int ret = syscall(__NR_io_uring_enter, d->ring_fd, d->ring_unsubmitted, 0, 0, NULL, 0);
+		if(ret < 0 && errno == EINTR) continue;
+		if(ret <= 0) return; // Left for ring_wait to submit
+		d->ring_unsubmitted -= ret;
+	}
+}
+
+// Worker thread: takes requests from the queue of disk arg until asked to stop
+static void *pool_worker( void *arg )
+{
+	ds_disk *d = arg;
+	char *aligned = NULL;
+	if(d->direct && posix_memalign((void **)&aligned, BLOCK_SIZE, BLOCK_SIZE)) fail();
+
+	pthread_mutex_lock(&d->pool_lock);
+	while(1) {
+		while(!d->pool_stop && d->pool_next == d->pool_count)
+			pthread_cond_wait(&d->pool_work, &d->pool_lock);
+		if(d->pool_stop) break;
+		request r = d->pool_queue[d->pool_next++];
+		pthread_mutex_unlock(&d->pool_lock);
+
+		if(!pio_transfer(d, r.write, r.number, r.count, r.buff, aligned)) fail();
+
+		pthread_mutex_lock(&d->pool_lock);
+		d->pool_finished++;
+		pthread_cond_signal(&d->pool_done);
+	}
+	pthread_mutex_unlock(&d->pool_lock);
+	free(aligned);
+	return arg;
+}
+
+// Starts the worker threads. Returns 0 if none could be created.
+static int pool_start( ds_disk *d )
+{
+	d->pool_stop = 0;
+	d->pool_next = d->pool_count = d->pool_finished = 0;
+	for(int i = 0; i < DS_THREADS; i++) {
+		if(pthread_create(&d->pool_threads[i], NULL, pool_worker, d)) break;
+		d->pool_started = i + 1;
+	}
+	return d->pool_started > 0;
+}
+
+// Stops and joins the worker threads
+static void pool_destroy( ds_disk *d )
+{
+	pthread_mutex_lock(&d->pool_lock);
+	d->pool_stop = 1;
+	pthread_cond_broadcast(&d->pool_work);
+	pthread_mutex_unlock(&d->pool_lock);
+	for(int i = 0; i < d->pool_started; i++)
+		pthread_join(d->pool_threads[i], NULL);
+	d->pool_started = 0;
+}
+
+// Waits for the submitted requests, with d->lock held. Requests are shared
+// by all threads, so this also completes those submitted by others.
+static void wait_locked( ds_disk *d )
 {
-	return number_blocks;
+	if(!d->async_pending) return;
+	if(d->ring_fd >= 0) {
+		ring_wait(d);
+	} else {
+		pthread_mutex_lock(&d->pool_lock);
+		while(d->pool_finished < d->pool_count)
+			pthread_cond_wait(&d->pool_done, &d->pool_lock);
+		d->pool_next = d->pool_count = d->pool_finished = 0;
+		pthread_mutex_unlock(&d->pool_lock);
+	}
+	d->async_pending = 0;
+	for(int i = 0; i < d->n_loading; i++) d->loading[i]->loading = 0;
+	d->n_loading = 0;
+}
+
+// Selects how ds_init accesses the disk file: DS_STDIO reads and writes
+// through the block cache, DS_MMAP maps the whole file and bypasses it,
+// DS_PIO uses pread/pwrite through the cache and runs asynchronous requests
+// concurrently. DS_DIRECT may be added to DS_PIO to open the file with
+// O_DIRECT. Must be called before ds_init.
+int ds_backend( ds_disk *d, int kind )
+{
+	int base = kind & ~DS_DIRECT;
+	if(d->disk_fd >= 0 || (base != DS_STDIO && base != DS_MMAP && base != DS_PIO) ||
+	   ((kind & DS_DIRECT) && base != DS_PIO)) {
+		errno = EINVAL;
+		return 0;
+	}
+	d->backend = base;
+	d->direct = (kind & DS_DIRECT) != 0;
+	return 1;
 }
 
 // Initializes the disk simulation with the given filename and number of blocks
-int ds_init( const char *filename, int n )
+int ds_init( ds_disk *d, const char *filename, int n )
 {
-	disk = fopen(filename,"r+");         // Try to open existing file
-	if(!disk) disk = fopen(filename,"w+"); // If not exist, create new file
-	if(!disk) return 0;                    // Return 0 on failure
+	if(d->backend == DS_PIO) {
+		d->disk_fd = open(filename, O_RDWR|O_CREAT|(d->direct ? O_DIRECT : 0), 0666);
+		if(d->disk_fd < 0) return 0;
+		if(d->direct && posix_memalign((void **)&d->bounce, BLOCK_SIZE, BLOCK_SIZE)) {
+			close(d->disk_fd);
+			d->disk_fd = -1;
+			errno = ENOMEM;
+			return 0;
+		}
+	} else {
+		d->disk = fopen(filename,"r+");         // Try to open existing file
+		if(!d->disk) d->disk = fopen(filename,"w+"); // If not exist, create new file
+		if(!d->disk) return 0;                    // Return 0 on failure
+		d->disk_fd = fileno(d->disk);
+	}
+
+	// Set file size to n blocks. A host file system that cannot hold a file
+	// that large fails here rather than on the first write past its limit.
+	if(ftruncate(d->disk_fd,(off_t)n * BLOCK_SIZE) < 0) {
+		int error = errno;
+		free(d->bounce);
+		d->bounce = NULL;
+		if(d->disk) fclose(d->disk);
+		else close(d->disk_fd);
+		d->disk = NULL;
+		d->disk_fd = -1;
+		errno = error;
+		return 0;
+	}
+
+	if(d->backend == DS_MMAP) {
+		// The mapping replaces the block cache
+		d->map = mmap(NULL, (size_t)n*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, d->disk_fd, 0);
+		if(d->map == MAP_FAILED) {
+			d->map = NULL;
+			fclose(d->disk);
+			d->disk = NULL;
+			d->disk_fd = -1;
+			return 0;
+		}
+	}
+
+	if(d->backend == DS_PIO && !ring_setup(d) && !pool_start(d)) {
+		free(d->bounce);
+		d->bounce = NULL;
+		close(d->disk_fd);
+		d->disk_fd = -1;
+		return 0;
+	}
 
-	ftruncate(fileno(disk),n * BLOCK_SIZE); // Set file size to n blocks
+	d->number_blocks = n;    // Store number of blocks
+	d->number_reads = 0;     // Reset read counter
+	d->number_writes = 0;    // Reset write counter
+	d->number_hits = 0;      // Reset cache hit counter
+	d->number_misses = 0;    // Reset cache miss counter
+	d->number_prefetched = 0;
+	d->number_prefetch_hits = 0;
+	memset(d->class_blocks, 0, sizeof(d->class_blocks));
+	d->next_block = 0;
+	d->async_pending = 0;
 
-	number_blocks = n;    // Store number of blocks
-	number_reads = 0;     // Reset read counter
-	number_writes = 0;    // Reset write counter
+	if(!d->map && !cache_create(d)) {
+		ds_close(d);
+		errno = ENOMEM;
+		return 0;
+	}
 
 	return 1; // Success
 }
 
 // Checks for valid block number and buffer pointer
-static void check( int number, const void *buff )
+static void check( ds_disk *d, int number, const void *buff )
 {
 	if(number<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",number);
 		abort();
 	}
 
-	if(number>=number_blocks) {
+	if(number>=d->number_blocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",number);
 		abort();
 	}
@@ -54,42 +873,333 @@ static void check( int number, const void *buff )
 }
 
 // Reads a block from disk into the buffer
-void ds_read( int number, char *buff )
-{
-	int x;
-	check(number,buff); // Validate block number and buffer pointer
-	fseek(disk,number*BLOCK_SIZE,SEEK_SET); // Move file pointer to correct block
-	x = fread(buff,BLOCK_SIZE,1,disk);      // Read one block into buffer
-	if(x==1) {
-		number_reads++; // Increment read counter if successful
+void ds_read( ds_disk *d, int number, char *buff )
+{
+	check(d, number,buff); // Validate block number and buffer pointer
+	pthread_mutex_lock(&d->lock);
+	if(d->async_pending) wait_locked(d);
+	if(!d->cache_buckets) {
+		disk_read(d, number, buff);
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+
+	cache_entry *e = cache_lookup(d, number);
+	if(e) {
+		d->number_hits++;
+		if(e->prefetched) {
+			d->number_prefetch_hits++;
+			e->prefetched = 0;
+		}
 	} else {
-		printf("disk simulation failed\n");
-		perror("ds");
-		exit(1); // Exit on failure
+		d->number_misses++;
+		e = cache_evict(d, number);
+		disk_read(d, number, e->data);
 	}
+	lru_remove(d, e);
+	lru_push(d, e);
+	memcpy(buff, e->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&d->lock);
 }
 
 // Writes a block from buffer to disk
-void ds_write( int number, const char *buff )
-{
-	int x;
-	check(number,buff); // Validate block number and buffer pointer
-	fseek(disk,number*BLOCK_SIZE,SEEK_SET); // Move file pointer to the correct block position
-	x = fwrite(buff,BLOCK_SIZE,1,disk); // Write one block of data from buffer to disk
-	if(x==1) {
-		number_writes++; // Increment write counter if successful
+void ds_write( ds_disk *d, int number, const char *buff )
+{
+	check(d, number,buff); // Validate block number and buffer pointer
+	pthread_mutex_lock(&d->lock);
+	if(d->async_pending) wait_locked(d);
+	if(!d->cache_buckets) {
+		disk_write(d, number, buff);
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+
+	// A whole block is written, so a miss never needs to read the old contents
+	cache_entry *e = cache_lookup(d, number);
+	if(e) {
+		d->number_hits++;
 	} else {
-		printf("disk simulation failed\n");
-		perror("ds");
-		exit(1); // Exit on failure
+		d->number_misses++;
+		e = cache_evict(d, number);
 	}
+	lru_remove(d, e);
+	lru_push(d, e);
+	memcpy(e->data, buff, BLOCK_SIZE);
+	e->dirty = 1;
+	pthread_mutex_unlock(&d->lock);
 }
 
-// Closes the disk and prints statistics
-void ds_close()
+// Starts the transfer of consecutive blocks that are not in the cache.
+// With DS_PIO it runs asynchronously; the other backends complete it here,
+// without holding d->lock so other threads can use the cache meanwhile.
+static void request_start( ds_disk *d, int write, int number, int count, char *buff )
+{
+	if(d->backend != DS_PIO) {
+		pthread_mutex_unlock(&d->lock);
+		disk_transfer(d, write, number, count, buff);
+		pthread_mutex_lock(&d->lock);
+		return;
+	}
+
+	// The io_uring bounce blocks hold a single block per request
+	if(d->direct && count > 1 && ((uintptr_t)buff % BLOCK_SIZE)) {
+		for(int i = 0; i < count; i++)
+			request_start(d, write, number + i, 1, buff + (size_t)i*BLOCK_SIZE);
+		return;
+	}
+
+	if(d->async_pending == DS_QUEUE_DEPTH) wait_locked(d);
+	account(d, write, number, count);
+
+	request r = { write, number, count, buff };
+	if(d->ring_fd >= 0) {
+		ring_queue(d, d->async_pending, r);
+	} else {
+		pthread_mutex_lock(&d->pool_lock);
+		d->pool_queue[d->pool_count++] = r;
+		pthread_cond_signal(&d->pool_work);
+		pthread_mutex_unlock(&d->pool_lock);
+	}
+	d->async_pending++;
+}
+
+// Starts transferring count consecutive blocks. Blocks held by the cache are
+// served from it at once; each run of other blocks becomes a single request
+// that goes to the disk without entering the cache.
+static void range_submit( ds_disk *d, int write, int number, int count, char *buff )
+{
+	check(d, number,buff); // Validate block numbers and buffer pointer
+	check(d, number+count-1,buff);
+
+	int run = 0; // First block of the current run of uncached blocks
+	for(int i = 0; i < count; i++) {
+		cache_entry *e = cache_lookup(d, number + i);
+		if(!e) continue;
+
+		if(i > run) {
+			d->number_misses += i - run;
+			request_start(d, write, number + run, i - run, buff + (size_t)run*BLOCK_SIZE);
+			// request_start may have dropped d->lock, and another thread
+			// may have evicted the block meanwhile
+			e = cache_lookup(d, number + i);
+			if(!e) {
+				run = i;
+				continue;
+			}
+		}
+		run = i + 1;
+
+		if(e->loading) wait_locked(d);
+		d->number_hits++;
+		if(e->prefetched && !write) d->number_prefetch_hits++;
+		e->prefetched = 0;
+		if(write) {
+			memcpy(e->data, buff + (size_t)i*BLOCK_SIZE, BLOCK_SIZE);
+			e->dirty = 1;
+		} else {
+			memcpy(buff + (size_t)i*BLOCK_SIZE, e->data, BLOCK_SIZE);
+		}
+		lru_remove(d, e);
+		lru_push(d, e);
+	}
+	if(count > run) {
+		if(d->cache_buckets) d->number_misses += count - run;
+		request_start(d, write, number + run, count - run, buff + (size_t)run*BLOCK_SIZE);
+	}
+}
+
+// Starts a vectored transfer: block numbers[i] to or from buffs[i]. Blocks
+// that are consecutive on disk and in memory are transferred as one run.
+static void vector_submit( ds_disk *d, int write, const int *numbers, char *const *buffs, int count )
+{
+	int run = 0; // First entry of the current run
+	for(int i = 1; i <= count; i++) {
+		if(i < count && numbers[i] == numbers[i-1] + 1 && buffs[i] == buffs[i-1] + BLOCK_SIZE)
+			continue;
+		range_submit(d, write, numbers[run], i - run, buffs[run]);
+		run = i;
+	}
+}
+
+// Starts reading a block into the buffer; the data is there after ds_wait
+void ds_submit_read( ds_disk *d, int number, char *buff )
+{
+	pthread_mutex_lock(&d->lock);
+	range_submit(d, 0, number, 1, buff);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Starts writing a block from the buffer, which must stay unchanged until
+// ds_wait returns
+void ds_submit_write( ds_disk *d, int number, const char *buff )
+{
+	pthread_mutex_lock(&d->lock);
+	range_submit(d, 1, number, 1, (char *)buff);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Reads count consecutive blocks starting at start into the buffer
+void ds_read_range( ds_disk *d, int start, int count, char *buff )
+{
+	if(count <= 0) return;
+	pthread_mutex_lock(&d->lock);
+	range_submit(d, 0, start, count, buff);
+	wait_locked(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Writes count consecutive blocks starting at start from the buffer
+void ds_write_range( ds_disk *d, int start, int count, const char *buff )
+{
+	if(count <= 0) return;
+	pthread_mutex_lock(&d->lock);
+	range_submit(d, 1, start, count, (char *)buff);
+	wait_locked(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Reads block numbers[i] into buffs[i] for each i, coalescing runs of
+// consecutive blocks into single transfers
+void ds_readv( ds_disk *d, const int *numbers, char *const *buffs, int count )
+{
+	if(count <= 0) return;
+	pthread_mutex_lock(&d->lock);
+	vector_submit(d, 0, numbers, buffs, count);
+	wait_locked(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Writes buffs[i] to block numbers[i] for each i, coalescing runs of
+// consecutive blocks into single transfers
+void ds_writev( ds_disk *d, const int *numbers, const char *const *buffs, int count )
+{
+	if(count <= 0) return;
+	pthread_mutex_lock(&d->lock);
+	vector_submit(d, 1, numbers, (char *const *)buffs, count);
+	wait_locked(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Reads consecutive blocks into cache entries with a single preadv
+static void prefetch_run( ds_disk *d, int number, struct iovec *iov, int count )
+{
+	if(!count) return;
+	if(preadv(d->disk_fd, iov, count, (off_t)number*BLOCK_SIZE) != (ssize_t)count*BLOCK_SIZE) fail();
+	account(d, 0, number, count);
+}
+
+// Starts reading block numbers[i] for each i into the cache ahead of its
+// use, skipping blocks already cached. With DS_PIO the reads run in the
+// background and only the blocks needed are waited for; DS_STDIO reads each
+// run of consecutive blocks with one preadv, and DS_MMAP leaves it to the
+// kernel. A single call takes at most half of the cache.
+void ds_prefetch( ds_disk *d, const int *numbers, int count )
+{
+	if(count <= 0) return;
+	if(d->map) {
+		for(int i = 0; i < count; i++) {
+			check(d, numbers[i], d->map);
+			madvise(d->map + (size_t)numbers[i]*BLOCK_SIZE, BLOCK_SIZE, MADV_WILLNEED);
+		}
+		return;
+	}
+
+	struct iovec iov[DS_QUEUE_DEPTH];
+	int run = 0, first = 0; // Blocks gathered for preadv, and the first of them
+	pthread_mutex_lock(&d->lock);
+	if(!d->cache_buckets) count = 0;
+	if(count > d->cache_capacity / 2) count = d->cache_capacity / 2;
+	for(int i = 0; i < count; i++) {
+		check(d, numbers[i], numbers);
+		if(run && (numbers[i] != first + run || run == DS_QUEUE_DEPTH)) {
+			prefetch_run(d, first, iov, run);
+			run = 0;
+		}
+		if(cache_lookup(d, numbers[i])) continue;
+
+		cache_entry *e = cache_evict(d, numbers[i]);
+		lru_remove(d, e);
+		lru_push(d, e);
+		e->prefetched = 1;
+		d->number_prefetched++;
+		if(d->backend == DS_PIO) {
+			request_start(d, 0, numbers[i], 1, e->data);
+			e->loading = 1;
+			d->loading[d->n_loading++] = e;
+		} else {
+			if(!run) first = numbers[i];
+			iov[run].iov_base = e->data;
+			iov[run++].iov_len = BLOCK_SIZE;
+		}
+	}
+	prefetch_run(d, first, iov, run);
+	if(d->ring_fd >= 0) ring_submit(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Waits until every submitted request has completed
+void ds_wait( ds_disk *d )
+{
+	pthread_mutex_lock(&d->lock);
+	wait_locked(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Returns a pointer to the block inside the mapped disk file, so it can be
+// read without a copy or updated in place (followed by ds_write on the same
+// pointer). Counts as a block read. Returns NULL unless the backend is DS_MMAP.
+char *ds_block_ptr( ds_disk *d, int number )
 {
-	printf("%d reads\n",number_reads);   // Print total number of reads
-	printf("%d writes\n",number_writes); // Print total number of writes
-	fclose(disk);                        // Close the disk file
+	if(!d->map) return NULL;
+	check(d, number,d->map);
+	account(d, 0, number, 1);
+	return d->map + (size_t)number*BLOCK_SIZE;
 }
 
+// Writes every dirty cached block back to the disk file
+void ds_flush( ds_disk *d )
+{
+	if(d->disk_fd < 0) return;
+	pthread_mutex_lock(&d->lock);
+	wait_locked(d);
+	if(d->map) {
+		msync(d->map, (size_t)d->number_blocks*BLOCK_SIZE, MS_SYNC);
+	} else {
+		for(cache_entry *e = d->lru_head; e; e = e->next) {
+			if(e->number >= 0 && e->dirty) {
+				disk_write(d, e->number, e->data);
+				e->dirty = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Closes the disk and prints statistics
+void ds_close( ds_disk *d )
+{
+	cache_destroy(d);                     // Write back dirty blocks
+	printf("%d reads\n",d->number_reads);   // Print total number of reads
+	printf("%d writes\n",d->number_writes); // Print total number of writes
+	printf("%d cache hits\n",d->number_hits);     // Print total number of cache hits
+	printf("%d cache misses\n",d->number_misses); // Print total number of cache misses
+	printf("%d blocks prefetched\n",d->number_prefetched);
+	printf("%d prefetch hits\n",d->number_prefetch_hits);
+	if(d->map) {
+		ds_flush(d);
+		munmap(d->map, (size_t)d->number_blocks*BLOCK_SIZE);
+		d->map = NULL;
+	}
+	if(d->ring_fd >= 0) ring_destroy(d);
+	if(d->pool_started) pool_destroy(d);
+	ds_trace(d, NULL);
+	free(d->class_singles);
+	d->class_singles = NULL;
+	d->n_class_singles = d->class_singles_capacity = d->n_class_ranges = 0;
+	free(d->bounce);
+	d->bounce = NULL;
+	if(d->disk) fclose(d->disk);               // Close the disk file
+	else close(d->disk_fd);
+	d->disk = NULL;
+	d->disk_fd = -1;
+}
@@ -1,7 +1,77 @@
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
+#define DS_CACHE_DEFAULT 64 // Default number of blocks kept in the cache
+
+#define DS_QUEUE_DEPTH 32   // Maximum asynchronous requests in flight
+#define DS_THREADS 4        // Worker threads when io_uring is not available
+
+// Disk backends for ds_backend
+#define DS_STDIO 0     // Synchronous pread/pwrite through the block cache
+#define DS_MMAP  1     // The whole disk file mapped in memory
+#define DS_PIO   2     // pread/pwrite through the block cache, asynchronous requests
+#define DS_DIRECT 0x100 // With DS_PIO, open the disk file with O_DIRECT
+
+// A simulated disk. Every function takes the disk it works on, so one
+// process may drive several disks, each with its own cache.
+typedef struct ds_disk ds_disk;
+
+// Classes of blocks, set by the file system with ds_set_class so the
+// counters can tell metadata from file data. Blocks start as DS_CLASS_DATA.
+// The disk keeps a few ranges and the blocks set one at a time, so fixed
+// regions should be set as ranges and only scattered blocks one by one.
+#define DS_CLASS_DATA  0
+#define DS_CLASS_SUPER 1
+#define DS_CLASS_DIR   2
+#define DS_CLASS_FAT   3
+#define DS_CLASSES     4
+
+// Counters of a disk since ds_init. A transfer is sequential when it starts
+// at the block after the previous transfer ended; in a random one, only the
+// first block counts as random and the rest as sequential.
+typedef struct{
+	long reads;           // Blocks read from the disk file
+	long writes;          // Blocks written to the disk file
+	long hits;            // Block requests served by the cache
+	long misses;          // Block requests that missed the cache
+	long prefetched;      // Blocks read ahead into the cache
+	long prefetch_hits;   // Prefetched blocks requested afterwards
+	long blocks[DS_CLASSES][2][2]; // Blocks transferred by class, [0] read or [1] write, [0] sequential or [1] random
+} ds_stats;
+
+// Record of the trace written by ds_trace, one per transfer to or from the
+// disk file, in host byte order
+typedef struct{
+	uint64_t time;     // Nanoseconds since the trace started
+	int32_t number;    // First block
+	int32_t count;     // Number of consecutive blocks
+	uint8_t write;     // 1 for a write, 0 for a read
+	uint8_t class;     // DS_CLASS_* of the first block
+	uint8_t pad[6];
+} ds_trace_record;
 
-int  ds_init( const char *filename, int number_blocks );
-int  ds_size();
-void ds_read( int number, char *buff );
-void ds_write( int number, const char *buff );
-void ds_close();
+ds_disk *ds_new();
+void ds_free( ds_disk *d );
+int  ds_init( ds_disk *d, const char *filename, int number_blocks );
+int  ds_cache( ds_disk *d, int blocks );
+int  ds_backend( ds_disk *d, int kind );
+int  ds_size( ds_disk *d );
+int  ds_reads( ds_disk *d );
+int  ds_writes( ds_disk *d );
+void ds_get_stats( ds_disk *d, ds_stats *st );
+void ds_set_class( ds_disk *d, int number, int count, int class );
+int  ds_trace( ds_disk *d, const char *filename );
+long ds_replay( ds_disk *d, const char *filename );
+void ds_read( ds_disk *d, int number, char *buff );
+void ds_write( ds_disk *d, int number, const char *buff );
+char *ds_block_ptr( ds_disk *d, int number );
+void ds_submit_read( ds_disk *d, int number, char *buff );
+void ds_submit_write( ds_disk *d, int number, const char *buff );
+void ds_wait( ds_disk *d );
+void ds_read_range( ds_disk *d, int start, int count, char *buff );
+void ds_write_range( ds_disk *d, int start, int count, const char *buff );
+void ds_readv( ds_disk *d, const int *numbers, char *const *buffs, int count );
+void ds_writev( ds_disk *d, const int *numbers, const char *const *buffs, int count );
+void ds_prefetch( ds_disk *d, const int *numbers, int count );
+void ds_flush( ds_disk *d );
+void ds_close( ds_disk *d );
@@ -1,171 +1,1063 @@
 #include "fat.h"
 #include "ds.h"
+#include "alloc.h"
+#include "fatcache.h"
 #include <errno.h>
-#include <math.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 // Block numbers for special regions on disk
 #define SUPER 0   // Superblock is at block 0
 #define TABLE 2   // FAT table starts at block 2
-#define DIR 1     // Directory is at block 1
+#define DIR 1     // Directory starts at block 1
 
 #define SIZE 1024 // General size constant (not used in this stub)
 
 // Superblock structure and magic number for file system identification
 #define MAGIC_N           0xAC0010DE
+#define FS_VERSION 3 // 0: one directory block, 6-letter names
+                     // 1: directory chained in the FAT, long names
+                     // 2: 64-bit file lengths
+                     // 3: FAT entry width in the superblock
 typedef struct{
 	int magic;              // Magic number to identify the file system
 	int number_blocks;      // Total number of blocks in the file system
 	int n_fat_blocks;       // Number of blocks used by the FAT table
-	char empty[BLOCK_SIZE-3*sizeof(int)]; // Padding to fill the block
+	int n_free_blocks;      // Number of free data blocks
+	int version;            // On-disk format version
+	int fat_width;          // Bytes per FAT entry, 2 or 4 (always 4 before version 3)
+	char empty[BLOCK_SIZE-6*sizeof(int)]; // Padding to fill the block
 } super;
 
-super sb; // Global superblock variable
-
-// Directory item structure and constants
-#define MAX_LETTERS 6      // Maximum file name length
+// Directory item structure and constants. The directory is a chain of
+// blocks in the FAT starting at DIR, grown one block at a time when full.
+#define MAX_LETTERS 54     // Maximum file name length
 #define OK 1
 #define NON_OK 0
 typedef struct{
+	int64_t length;             // File length in bytes
+	unsigned int first;         // First block of the file in FAT
 	unsigned char used;         // 1 if entry is used, 0 if free
 	char name[MAX_LETTERS+1];   // File name (null-terminated)
-	unsigned int length;        // File length in bytes
-	unsigned int first;         // First block of the file in FAT
 } dir_item;
 
 #define N_ITEMS (BLOCK_SIZE / sizeof(dir_item)) // Number of directory entries per block
-dir_item dir[N_ITEMS]; // Directory table in memory
 
-// FAT table constants and pointer
+// Largest file: its logical block numbers must fit in an int
+#define MAX_FILE_SIZE ((long)INT_MAX * BLOCK_SIZE)
+
+// Per-file block index: physical block of each logical block of a file,
+// built on first access and extended as the chain grows, so seeking to any
+// offset is a table lookup instead of a chain walk.
+typedef struct{
+	unsigned int *blocks;    // Physical block of each logical block
+	int count;               // Number of valid entries in blocks
+	int capacity;            // Number of entries allocated in blocks
+} block_index;
+
+// Readahead state of a file. A read that starts where the previous one
+// ended opens the window, and each time the reads get within half a window
+// of the prefetched blocks the window doubles, up to RA_MAX blocks; any
+// other read closes it.
+#define RA_MIN 4   // Window opened by a sequential read, in blocks
+#define RA_MAX 32  // Largest window, in blocks
+typedef struct{
+	int next;      // Logical block a sequential read starts at
+	int end;       // First logical block not prefetched yet
+	int window;    // Blocks kept prefetched ahead of the reads, 0 if closed
+} readahead;
+
+// Data appended to a file in delayed allocation mode and not written yet:
+// the bytes from start to start+length, where start is the length of the
+// file on disk. Blocks for it are only promised, not allocated, until the
+// data is flushed, so they can come in one extent.
+#define DELALLOC_MAX (4<<20)     // Largest buffer of one file, in bytes
+#define DELALLOC_TOTAL (64<<20)  // Largest amount buffered by all files, in bytes
+typedef struct{
+	char *data;     // Buffered bytes, NULL if none
+	long start;     // Offset of the first buffered byte
+	int length;     // Number of buffered bytes
+	int capacity;   // Size of data
+	int promised;   // Free blocks promised to the buffered bytes
+} writeback;
+
+// Directory block in memory: the entries as stored on disk, followed by the
+// state kept for each file. Blocks are allocated one at a time, so an entry
+// and its locks never move when the directory grows.
+typedef struct{
+	dir_item items[N_ITEMS];          // Entries as stored on disk
+	char tail[BLOCK_SIZE - N_ITEMS * sizeof(dir_item)]; // Rest of the disk block, transferred with them
+	unsigned int number;              // Disk block holding the entries
+	pthread_rwlock_t lock[N_ITEMS];   // Shared to read the file, exclusive to change it
+	pthread_mutex_t walk[N_ITEMS];    // Protects the block index, the readahead state and the cursors of the file
+	block_index index[N_ITEMS];       // Block index of each file
+	readahead ra[N_ITEMS];            // Readahead state of each file
+	writeback wb[N_ITEMS];            // Buffered data of each file, changed with the file lock exclusive
+} dir_block;
+
+// Directory entry of format version 0, upgraded at mount time
+#define OLD_LETTERS 6
+typedef struct{
+	unsigned char used;
+	char name[OLD_LETTERS+1];
+	unsigned int length;
+	unsigned int first;
+} old_dir_item;
+#define OLD_ITEMS (BLOCK_SIZE / sizeof(old_dir_item))
+
+// Directory entry of format version 1, with a 32-bit length, upgraded at
+// mount time
+typedef struct{
+	unsigned int length;
+	unsigned int first;
+	unsigned char used;
+	char name[MAX_LETTERS+1];
+} v1_dir_item;
+#define V1_ITEMS (BLOCK_SIZE / sizeof(v1_dir_item))
+
+// FAT table constants
 #define FREE 0   // Block is free
 #define EOFF 1   // End of file chain
 #define BUSY 2   // Block is in use (not standard FAT, but used here)
-unsigned int *fat; // Pointer to FAT table in memory
+#define FAT16_BLOCKS 0x10000 // Largest image formatted with 2-byte FAT entries
 
-int mountState = 0; // 1 if file system is mounted, 0 otherwise
+__thread int meta_writes = 0; // Metadata blocks written by the last operation of this thread
 
-// Formats the file system  
-int fat_format(){ 
-	if(mountState){//sistema ta montado, nao pode formatar
-		errno = EBUSY; 
+// Open file handles. Each caches the directory entry of the file and its
+// per-file state, which stay in place while the file exists, and the last
+// (logical block, physical block) pair visited, so sequential access
+// continues from there instead of walking the chain from the first block.
+#define N_HANDLES 32
+typedef struct{
+	int used;                // 1 if the handle is open
+	int slot;                // Directory entry of the open file
+	dir_item *item;          // The entry itself
+	block_index *index;      // Block index of the file
+	readahead *ra;           // Readahead state of the file
+	writeback *wb;           // Buffered data of the file
+	pthread_rwlock_t *lock;  // Lock of the file
+	pthread_mutex_t *walk;   // Protects index and the cursor below
+	int cur_logical;         // Logical block of the cursor, -1 if unset
+	unsigned int cur_block;  // Physical block of the cursor
+} handle;
+
+// State of one mounted image: the superblock, FAT and directory in memory,
+// the allocator, the open handles and the locks.
+struct fat_fs {
+	ds_disk *disk;             // Disk holding the image
+	super sb;                  // Superblock
+	int mountState;            // 1 if file system is mounted, 0 otherwise
+
+	char *fat;                 // FAT table in memory as on disk, NULL if loaded on demand
+	// Accessors of the FAT entries, picked at mount time for the entry
+	// width and for a FAT in memory or loaded on demand
+	unsigned int (*get_entry)(fat_fs *fs, unsigned int block);
+	void (*set_entry)(fat_fs *fs, unsigned int block, unsigned int value);
+	unsigned char *fat_dirty;  // One flag per FAT block, 1 if it must be written back
+	fat_cache fat_pages;       // FAT blocks in memory when it is loaded on demand
+	int fat_budget;            // FAT blocks kept in memory on demand, 0 to load it whole
+	allocator alloc;           // Free blocks, built from the FAT at mount time
+
+	// With the FAT loaded on demand, the allocator is built by a thread
+	// that scans the FAT after the mount returns. Until it is done, only
+	// the free blocks of the FAT blocks scanned so far are known.
+	pthread_t scanner;
+	int scanning;              // 1 while the scanner runs
+	int scan_stop;             // 1 to make the scanner give up
+	pthread_cond_t scan_done;  // Signaled when the scanner finishes
+	int has_scanner;           // 1 if the scanner thread must be joined
+
+	dir_block **dir;           // Directory blocks in memory, in chain order
+	int n_dir_blocks;          // Number of blocks in the directory
+	int n_entries;             // Number of directory entries (n_dir_blocks * N_ITEMS)
+
+	// Directory name index: hash chains of the used directory entries keyed
+	// by name, and a list of the free entries, built at mount time. An entry
+	// is in exactly one of them, linked through name_next.
+	int *name_bucket;          // First entry of each hash chain, -1 if empty
+	int *name_next;            // Next entry in the same chain or in the free list
+	int name_buckets;          // Number of hash chains (a power of two)
+	int free_entry;            // First free directory entry, -1 if the directory is full
+
+	int index_enabled;         // 1 if seeks use the per-file block index
+	int delalloc;              // 1 if appends are buffered until flushed
+	int promised;              // Free blocks promised to buffered data
+	int buffered;              // Bytes buffered by all files
+	fat_stats stats;           // Latency of the public calls, updated atomically
+	handle handles[N_HANDLES]; // Open file handles
+
+	// Locks, always taken in this order: a file's lock and walk mutex, then
+	// dir_lock, then alloc_lock. dir_lock protects the directory blocks
+	// array, the name index, the entries' names and lengths, and the open
+	// handles, and the extent of the buffered data; alloc_lock protects the
+	// allocator, the FAT, the superblock, promised and buffered.
+	// Mounting and formatting must not run concurrently with anything else.
+	pthread_mutex_t dir_lock;
+	pthread_mutex_t alloc_lock;
+};
+
+// Timing of the public calls for fat_get_stats. TIMED at the top of a call
+// starts a timer that is read when the call returns; a call made inside
+// another one, like fat_open inside fat_write, only counts as the outer one.
+typedef struct{
+	fat_fs *fs;
+	int op;
+	struct timespec start;
+} op_timer;
+
+static __thread int op_depth = 0; // Timed calls in progress in this thread
+
+static op_timer op_start(fat_fs *fs, int op){
+	op_timer t = { .fs = fs, .op = op };
+	if (op_depth++ == 0) clock_gettime(CLOCK_MONOTONIC, &t.start);
+	return t;
+}
+
+static void op_done(op_timer *t){
+	if (--op_depth) return;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long ns = (end.tv_sec - t->start.tv_sec) * 1000000000L + end.tv_nsec - t->start.tv_nsec;
+	long us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzl(us) : 0;
+	if (bucket >= FAT_LAT_BUCKETS) bucket = FAT_LAT_BUCKETS - 1;
+	fat_stats *st = &t->fs->stats;
+	__atomic_add_fetch(&st->calls[t->op], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->nanos[t->op], ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->latency[t->op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+#define TIMED(fs, op) op_timer timer __attribute__((cleanup(op_done))) = op_start(fs, op)
+
+// Tells the disk which blocks hold the superblock, the FAT and the first
+// directory block, for its counters. The other directory blocks are marked
+// as they join the chain.
+static void classify(fat_fs *fs){
+	ds_set_class(fs->disk, 0, fs->sb.number_blocks, DS_CLASS_DATA);
+	ds_set_class(fs->disk, SUPER, 1, DS_CLASS_SUPER);
+	ds_set_class(fs->disk, DIR, 1, DS_CLASS_DIR);
+	ds_set_class(fs->disk, TABLE, fs->sb.n_fat_blocks, DS_CLASS_FAT);
+}
+
+static unsigned int get16(fat_fs *fs, unsigned int block){
+	return ((uint16_t *)fs->fat)[block];
+}
+
+static unsigned int get32(fat_fs *fs, unsigned int block){
+	return ((uint32_t *)fs->fat)[block];
+}
+
+static unsigned int get_paged(fat_fs *fs, unsigned int block){
+	return fatcache_get(&fs->fat_pages, block);
+}
+
+static void set16(fat_fs *fs, unsigned int block, unsigned int value){
+	((uint16_t *)fs->fat)[block] = value;
+	fs->fat_dirty[block / FAT_ENTRIES(2)] = 1;
+}
+
+static void set32(fat_fs *fs, unsigned int block, unsigned int value){
+	((uint32_t *)fs->fat)[block] = value;
+	fs->fat_dirty[block / FAT_ENTRIES(4)] = 1;
+}
+
+static void set_paged(fat_fs *fs, unsigned int block, unsigned int value){
+	fatcache_set(&fs->fat_pages, block, value);
+}
+
+// Picks the accessors of the FAT entries, once the FAT is in memory or its
+// page cache is ready
+static void fat_access(fat_fs *fs){
+	if (!fs->fat) {
+		fs->get_entry = get_paged;
+		fs->set_entry = set_paged;
+	} else if (fs->sb.fat_width == 2) {
+		fs->get_entry = get16;
+		fs->set_entry = set16;
+	} else {
+		fs->get_entry = get32;
+		fs->set_entry = set32;
+	}
+}
+
+// Returns a FAT entry
+static unsigned int fat_get(fat_fs *fs, unsigned int block){
+	return fs->get_entry(fs, block);
+}
+
+// Changes a FAT entry and marks the FAT block holding it as dirty.
+// Called with alloc_lock held once mounted.
+static void fat_set(fat_fs *fs, unsigned int block, unsigned int value){
+	fs->set_entry(fs, block, value);
+}
+
+// Writes back only the FAT blocks marked as dirty, and the superblock
+// if the free block count changed. While the scanner runs, the count is
+// not known yet.
+static void fat_sync(fat_fs *fs){
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (!fs->fat) {
+		meta_writes += fatcache_sync(&fs->fat_pages);
+	} else {
+		for (int i = 0; i < fs->sb.n_fat_blocks; i++) {
+			if (fs->fat_dirty[i]) {
+				ds_write(fs->disk, TABLE + i, fs->fat + (size_t)i * BLOCK_SIZE);
+				fs->fat_dirty[i] = 0;
+				meta_writes++;
+			}
+		}
+	}
+	if (!fs->scanning && fs->sb.n_free_blocks != alloc_free_count(&fs->alloc)) {
+		fs->sb.n_free_blocks = alloc_free_count(&fs->alloc);
+		ds_write(fs->disk, SUPER, (char *)&fs->sb);
+		meta_writes++;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// Waits for the scanner to finish, with alloc_lock held
+static void scan_wait(fat_fs *fs){
+	while (fs->scanning)
+		pthread_cond_wait(&fs->scan_done, &fs->alloc_lock);
+}
+
+// Returns the free blocks not promised to buffered data, plus the `own`
+// blocks promised to the caller's. While the scanner runs, blocks it has
+// not reached yet do not count, so it is waited for if they fall short of
+// need. Called with alloc_lock held.
+static int free_space(fat_fs *fs, int own, int need){
+	if (alloc_free_count(&fs->alloc) - fs->promised + own < need)
+		scan_wait(fs);
+	return alloc_free_count(&fs->alloc) - fs->promised + own;
+}
+
+// Chooses where the next extent of a chain ending at `last` starts: right
+// after last when that block is free, so the file grows in place, and
+// otherwise in one of the longest free runs. When another chain ends just
+// before that run it may grow into it, so the new extent starts halfway
+// along, or late enough to hold count blocks; new chains are then spread
+// out in proportion to the free space. Called with alloc_lock held.
+static int extent_goal(fat_fs *fs, unsigned int last, int count){
+	if (last != EOFF && alloc_is_free(&fs->alloc, last + 1)) return last + 1;
+	int length;
+	int start = alloc_longest(&fs->alloc, &length);
+	if (start > 0 && fat_get(fs, start - 1) == EOFF) {
+		int skip = length / 2;
+		if (length - skip < count) skip = length > count ? length - count : 0;
+		start += skip;
+	}
+	return start;
+}
+
+// Allocates count blocks and makes them the end of a chain, linked after
+// block `last` unless it is EOFF. The blocks come in as few extents as the
+// free space allows, placed by extent_goal. Returns the first new block,
+// or -1 if the disk is full; fewer blocks than asked for are linked when
+// it fills up on the way.
+static int chain_append(fat_fs *fs, unsigned int last, int count){
+	int first = -1, got;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while (count > 0) {
+		int goal = extent_goal(fs, last, count);
+		int block = alloc_extent(&fs->alloc, goal, count, &got);
+		if (block == -1 && fs->scanning) {
+			scan_wait(fs);
+			continue;
+		}
+		if (block == -1) break;
+		for (int i = 0; i < got; i++) {
+			fat_set(fs, block + i, EOFF);
+			if (last != EOFF) fat_set(fs, last, block + i);
+			last = block + i;
+		}
+		if (first == -1) first = block;
+		count -= got;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return first;
+}
+
+// Returns a directory entry. Called with dir_lock held once mounted, since
+// the array of directory blocks moves when the directory grows.
+static dir_item *entry(fat_fs *fs, int slot){
+	return &fs->dir[slot / N_ITEMS]->items[slot % N_ITEMS];
+}
+
+// Writes back the directory block holding an entry, with dir_lock held
+static void dir_sync(fat_fs *fs, int slot){
+	dir_block *b = fs->dir[slot / N_ITEMS];
+	ds_write(fs->disk, b->number, (char *)b->items);
+	meta_writes++;
+}
+
+// Returns the number of metadata blocks written by the last operation
+// of the calling thread
+int fat_meta_writes(){
+	return meta_writes;
+}
+
+// FNV-1a hash of a file name
+static unsigned int name_hash(const char *name){
+	unsigned int h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Builds the name index over the first `entries` directory entries
+static int dir_index_build(fat_fs *fs, int entries){
+	free(fs->name_bucket);
+	free(fs->name_next);
+	fs->name_buckets = 1;
+	while (fs->name_buckets < entries) fs->name_buckets *= 2;
+	fs->name_bucket = malloc(fs->name_buckets * sizeof(int));
+	fs->name_next = malloc(entries * sizeof(int));
+	if (!fs->name_bucket || !fs->name_next) {
+		free(fs->name_bucket);
+		free(fs->name_next);
+		fs->name_bucket = fs->name_next = NULL;
+		errno = ENOMEM;
 		return -1;
 	}
+	for (int i = 0; i < fs->name_buckets; i++)
+		fs->name_bucket[i] = -1;
+
+	// free entries are listed in increasing order, so the lowest is used first
+	fs->free_entry = -1;
+	for (int i = entries - 1; i >= 0; i--) {
+		if (entry(fs, i)->used) {
+			unsigned int b = name_hash(entry(fs, i)->name) & (fs->name_buckets - 1);
+			fs->name_next[i] = fs->name_bucket[b];
+			fs->name_bucket[b] = i;
+		} else {
+			fs->name_next[i] = fs->free_entry;
+			fs->free_entry = i;
+		}
+	}
+	return 0;
+}
 
-	sb.magic = MAGIC_N;
-	sb.number_blocks = ds_size();
-	sb.n_fat_blocks = (int)ceil((float)sb.number_blocks * sizeof(unsigned int) / BLOCK_SIZE);
+// Returns the directory entry of a file, or -1 if it does not exist
+static int dir_lookup(fat_fs *fs, const char *name){
+	int i = fs->name_bucket[name_hash(name) & (fs->name_buckets - 1)];
+	while (i != -1 && strcmp(entry(fs, i)->name, name))
+		i = fs->name_next[i];
+	return i;
+}
 
-	//escreve o superbloco no disco
-	ds_write(SUPER, (char *)&sb);
+// Takes the first free directory entry and indexes it under name; the
+// caller fills in the entry afterwards, and must copy the same name into
+// it. Returns the entry, or -1 if the directory is full.
+static int dir_index_add(fat_fs *fs, const char *name){
+	int i = fs->free_entry;
+	if (i == -1) return -1;
+	fs->free_entry = fs->name_next[i];
+	unsigned int b = name_hash(name) & (fs->name_buckets - 1);
+	fs->name_next[i] = fs->name_bucket[b];
+	fs->name_bucket[b] = i;
+	return i;
+}
+
+// Removes a directory entry from its hash chain and puts it back in the free list
+static void dir_index_remove(fat_fs *fs, int slot){
+	int *p = &fs->name_bucket[name_hash(entry(fs, slot)->name) & (fs->name_buckets - 1)];
+	while (*p != slot)
+		p = &fs->name_next[*p];
+	*p = fs->name_next[slot];
+	fs->name_next[slot] = fs->free_entry;
+	fs->free_entry = slot;
+}
 
-	//inicializa o diretorio, macando as entradas como nao usadas
-	for(int i = 0; i < N_ITEMS; i++){
-		dir[i].used = 0;
+// Allocates an empty directory block held at disk block `number`
+static dir_block *dir_block_new(unsigned int number){
+	dir_block *b = calloc(1, sizeof(dir_block));
+	if (!b) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	ds_write(DIR, (char *)dir);
+	b->number = number;
+	for (int i = 0; i < N_ITEMS; i++) {
+		pthread_rwlock_init(&b->lock[i], NULL);
+		pthread_mutex_init(&b->walk[i], NULL);
+	}
+	return b;
+}
 
-	//inicializa a fat
-	fat = malloc(sizeof(unsigned int) * sb.number_blocks);
-	if(!fat){
+// Appends an empty block to the directory and puts its entries in the free
+// list, with dir_lock held. The name index is rebuilt when the entries
+// outgrow its hash chains.
+static int dir_grow(fat_fs *fs){
+	int count = fs->n_entries + N_ITEMS;
+	dir_block **new_dir = realloc(fs->dir, (fs->n_dir_blocks + 1) * sizeof(dir_block *));
+	if (new_dir) fs->dir = new_dir;
+	int *new_next = realloc(fs->name_next, count * sizeof(int));
+	if (new_next) fs->name_next = new_next;
+	if (!new_dir || !new_next) {
 		errno = ENOMEM;
 		return -1;
 	}
-	for(int i = 0; i < sb.number_blocks; i++){
-		fat[i] = FREE;
+
+	dir_block *b = dir_block_new(0);
+	if (!b) return -1;
+	int block = chain_append(fs, EOFF, 1);
+	if (block == -1) {
+		free(b);
+		errno = ENOSPC;
+		return -1;
+	}
+	// DIR has the same number as EOFF, so chain_append cannot link after it
+	pthread_mutex_lock(&fs->alloc_lock);
+	fat_set(fs, fs->dir[fs->n_dir_blocks - 1]->number, block);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	b->number = block;
+	fs->dir[fs->n_dir_blocks++] = b;
+	ds_set_class(fs->disk, block, 1, DS_CLASS_DIR);
+
+	for (int i = count - 1; i >= fs->n_entries; i--) {
+		fs->name_next[i] = fs->free_entry;
+		fs->free_entry = i;
+	}
+	fs->n_entries = count;
+	ds_write(fs->disk, block, (char *)b->items);
+	meta_writes++;
+	fat_sync(fs);
+
+	if (fs->n_entries > fs->name_buckets)
+		return dir_index_build(fs, fs->n_entries);
+	return 0;
+}
+
+// Drops a block index
+static void index_drop(block_index *ix){
+	free(ix->blocks);
+	ix->blocks = NULL;
+	ix->count = 0;
+	ix->capacity = 0;
+}
+
+// Appends a physical block to a block index.
+// On allocation failure the index is dropped and 0 is returned.
+static int index_append(block_index *ix, unsigned int block){
+	if (ix->count == ix->capacity) {
+		int capacity = ix->capacity ? 2 * ix->capacity : 16;
+		unsigned int *blocks = realloc(ix->blocks, capacity * sizeof(unsigned int));
+		if (!blocks) {
+			index_drop(ix);
+			return 0;
+		}
+		ix->blocks = blocks;
+		ix->capacity = capacity;
 	}
+	ix->blocks[ix->count++] = block;
+	return 1;
+}
 
-	// Marcar blocos reservados como ocupados
-	fat[SUPER] = BUSY;
-	fat[DIR] = BUSY;
-	for (int i = 0; i < sb.n_fat_blocks; i++) {
-		fat[TABLE + i] = BUSY;
+// Returns the block index of a file, walking the chain once to build it if
+// needed, or NULL if indexing is off or out of memory
+static block_index *index_load(fat_fs *fs, block_index *ix, dir_item *item){
+	if (!fs->index_enabled) return NULL;
+	if (ix->blocks) return ix;
+
+	unsigned int current = item->first;
+	int safety_counter = 0;
+	while (current != EOFF && current < fs->sb.number_blocks && safety_counter < fs->sb.number_blocks) {
+		if (!index_append(ix, current)) return NULL;
+		current = fat_get(fs, current);
+		safety_counter++;
 	}
+	if (!ix->blocks && !index_append(ix, EOFF)) return NULL;
+	if (ix->blocks[0] == EOFF) ix->count = 0; // Empty chain, keep the allocation
+	return ix;
+}
 
-	char fat_buffer[BLOCK_SIZE]; 
-	int entries_per_block = BLOCK_SIZE / sizeof(unsigned int);
+// Turns the per-file block index on or off. Must not run concurrently
+// with reads and writes.
+void fat_set_index(fat_fs *fs, int enable){
+	fs->index_enabled = enable;
+	if (!enable) {
+		for (int i = 0; i < fs->n_entries; i++)
+			index_drop(&fs->dir[i / N_ITEMS]->index[i % N_ITEMS]);
+	}
+}
 
-	// copiar buffer pra FAT
-	for (int i = 0; i < sb.n_fat_blocks; i++) {
-		memcpy(fat_buffer, fat + i * entries_per_block, BLOCK_SIZE);
-		ds_write(TABLE + i, fat_buffer);
+// Formats the file system  
+int fat_format(fat_fs *fs){ 
+	if(fs->mountState){//sistema ta montado, nao pode formatar
+		errno = EBUSY; 
+		return -1;
 	}
 
-	free(fat);
+	fs->sb.magic = MAGIC_N;
+	fs->sb.number_blocks = ds_size(fs->disk);
+	//imagens pequenas usam entradas de 2 bytes: a fat ocupa metade
+	fs->sb.fat_width = fs->sb.number_blocks <= FAT16_BLOCKS ? 2 : 4;
+	fs->sb.n_fat_blocks = (int)(((long)fs->sb.number_blocks * fs->sb.fat_width + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	fs->sb.n_free_blocks = fs->sb.number_blocks - TABLE - fs->sb.n_fat_blocks;
+	fs->sb.version = FS_VERSION;
+	classify(fs);
+
+	//escreve o superbloco no disco
+	ds_write(fs->disk, SUPER, (char *)&fs->sb);
+
+	//inicializa o diretorio com um bloco de entradas nao usadas
+	char dir_buffer[BLOCK_SIZE];
+	memset(dir_buffer, 0, BLOCK_SIZE);
+	ds_write(fs->disk, DIR, dir_buffer);
+
+	//inicializa a fat bloco a bloco, sem guarda-la inteira na memoria:
+	//blocos livres, menos os reservados, que ficam ocupados
+	char fat_buffer[BLOCK_SIZE];
+	int width = fs->sb.fat_width;
+	const fat_entry_access *access = fat_entries(width);
+	for (int i = 0; i < fs->sb.n_fat_blocks; i++) {
+		for (int k = 0; k < FAT_ENTRIES(width); k++) {
+			long block = (long)i * FAT_ENTRIES(width) + k;
+			unsigned int value = FREE;
+			if (block == DIR)
+				value = EOFF; // o diretorio e uma cadeia de um bloco so
+			else if (block == SUPER || (block >= TABLE && block < TABLE + fs->sb.n_fat_blocks))
+				value = BUSY;
+			access->set(fat_buffer, k, value);
+		}
+		ds_write(fs->disk, TABLE + i, fat_buffer);
+	}
   	return 0;
 }
 
+// Prints the size and block chain of a file for fat_debug
+static void debug_file(const char *name, long length, unsigned int first,
+                       const char *aux_fat, const fat_entry_access *access, int number_blocks){
+	printf("File \"%s\":\n", name);
+	printf("\tsize: %ld bytes\n", length);
+
+	printf("\tBlocks:");
+	unsigned int block = first, prev = EOFF;
+	int safety_counter = 0, extents = 0;
+	while (block != EOFF && block < number_blocks && safety_counter < number_blocks) {
+		printf("%u ", block);
+		if (prev == EOFF || block != prev + 1) extents++;
+		prev = block;
+		block = access->get(aux_fat, block);
+		safety_counter++;
+	}
+	printf("\n");
+	printf("\textents: %d\n", extents);
+}
+
 // Prints debugging information about the file system  
-void fat_debug(){
+void fat_debug(fat_fs *fs){
 	// superblock info
 	super aux_sb;
 	//why aux? we could possibly mess up the other operations if the global superblock variable was modified
-	ds_read(SUPER, (char*) &aux_sb);
+	ds_read(fs->disk, SUPER, (char*) &aux_sb);
 	printf("superblock:\n");
 	if (aux_sb.magic == MAGIC_N) {
 		printf("\tmagic is ok\n");
+		printf("\tformat version %d\n", aux_sb.version);
 		printf("\t%d blocks\n", aux_sb.number_blocks);
 		printf("\t%d block fat\n", aux_sb.n_fat_blocks);
+		printf("\t%d-bit fat entries\n", aux_sb.version < 3 ? 32 : aux_sb.fat_width * 8);
+		printf("\t%d free blocks\n", aux_sb.n_free_blocks);
 	} else {
 		printf("\tmagic is NOT ok\n");
 	}
 
 	//read fat. we must be able to debug the filesystem even if it is not mounted
-	unsigned int* aux_fat = malloc(sizeof(unsigned int) * aux_sb.number_blocks);
+	const fat_entry_access *access = fat_entries(aux_sb.version < 3 ? 4 : aux_sb.fat_width);
+	char *aux_fat = malloc((size_t)aux_sb.n_fat_blocks * BLOCK_SIZE);
 	for (int i = 0; i < aux_sb.n_fat_blocks; i++) {
 		// read every row
-		ds_read(TABLE + i, (char*) (aux_fat + i * BLOCK_SIZE / sizeof(unsigned int)));
+		ds_read(fs->disk, TABLE + i, aux_fat + (size_t)i * BLOCK_SIZE);
+	}
+
+	// read directory, block by block along its chain (a single block in version 0).
+	// DIR has the same number as EOFF, so the chain is followed after each block.
+	char dir_buffer[BLOCK_SIZE];
+	unsigned int dir_block = DIR;
+	int safety_counter = 0;
+	do {
+		ds_read(fs->disk, dir_block, dir_buffer);
+		if (aux_sb.version == 0) {
+			old_dir_item *aux_dir = (old_dir_item *)dir_buffer;
+			for (int i = 0; i < OLD_ITEMS; i++)
+				if (aux_dir[i].used)
+					debug_file(aux_dir[i].name, aux_dir[i].length, aux_dir[i].first, aux_fat, access, aux_sb.number_blocks);
+			break;
+		}
+		if (aux_sb.version == 1) {
+			v1_dir_item *aux_dir = (v1_dir_item *)dir_buffer;
+			for (int i = 0; i < V1_ITEMS; i++)
+				if (aux_dir[i].used)
+					debug_file(aux_dir[i].name, aux_dir[i].length, aux_dir[i].first, aux_fat, access, aux_sb.number_blocks);
+		} else {
+			dir_item *aux_dir = (dir_item *)dir_buffer;
+			for (int i = 0; i < N_ITEMS; i++)
+				if (aux_dir[i].used)
+					debug_file(aux_dir[i].name, aux_dir[i].length, aux_dir[i].first, aux_fat, access, aux_sb.number_blocks);
+		}
+		dir_block = access->get(aux_fat, dir_block);
+		safety_counter++;
+	} while (dir_block != EOFF && dir_block < aux_sb.number_blocks && safety_counter < aux_sb.number_blocks);
+
+	free(aux_fat);
+}
+
+// Allocates the in-memory directory for a number of blocks, all entries free
+static int dir_alloc(fat_fs *fs, int blocks){
+	fs->dir = calloc(blocks, sizeof(dir_block *));
+	if (!fs->dir) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (fs->n_dir_blocks = 0; fs->n_dir_blocks < blocks; fs->n_dir_blocks++) {
+		fs->dir[fs->n_dir_blocks] = dir_block_new(0);
+		if (!fs->dir[fs->n_dir_blocks]) return -1;
 	}
+	fs->n_entries = blocks * N_ITEMS;
+	return 0;
+}
 
-	// read directory
-	dir_item aux_dir[N_ITEMS]; 
-	ds_read(DIR, (char*) aux_dir);
+// Releases the in-memory directory and its indexes
+static void dir_free(fat_fs *fs){
+	for (int b = 0; b < fs->n_dir_blocks; b++) {
+		for (int i = 0; i < N_ITEMS; i++) {
+			index_drop(&fs->dir[b]->index[i]);
+			free(fs->dir[b]->wb[i].data);
+			pthread_rwlock_destroy(&fs->dir[b]->lock[i]);
+			pthread_mutex_destroy(&fs->dir[b]->walk[i]);
+		}
+		free(fs->dir[b]);
+	}
+	free(fs->dir);
+	free(fs->name_bucket);
+	free(fs->name_next);
+	fs->dir = NULL;
+	fs->name_bucket = fs->name_next = NULL;
+	fs->n_dir_blocks = fs->n_entries = fs->name_buckets = 0;
+}
 
-	unsigned int block;
-	for (int i = 0; i < N_ITEMS; i++) {
-		if (aux_dir[i].used) {
-			printf("File \"%s\":\n", aux_dir[i].name);
-			printf("\tsize: %u bytes\n", aux_dir[i].length);
-
-			printf("\tBlocks:");
-			block = aux_dir[i].first;
-			unsigned int block = aux_dir[i].first;
-			int safety_counter = 0;
-			
-			while (block != EOFF && block < aux_sb.number_blocks && safety_counter < aux_sb.number_blocks) {
-				printf("%u ", block);
-				block = aux_fat[block];
-				safety_counter++;
+// Returns the number of blocks in the directory chain. DIR has the same
+// number as EOFF, so the chain is followed after counting each block.
+static int dir_chain_length(fat_fs *fs){
+	int blocks = 0;
+	unsigned int block = DIR;
+	do {
+		block = fat_get(fs, block);
+		blocks++;
+	} while (block != EOFF && block < fs->sb.number_blocks && blocks < fs->sb.number_blocks);
+	return blocks;
+}
+
+// Brings the directory chain to memory
+static int dir_load(fat_fs *fs){
+	int blocks = dir_chain_length(fs);
+	if (dir_alloc(fs, blocks) < 0) return -1;
+
+	int *numbers = malloc(blocks * sizeof(int));
+	char **buffs = malloc(blocks * sizeof(char *));
+	if (!numbers || !buffs) {
+		free(numbers);
+		free(buffs);
+		errno = ENOMEM;
+		return -1;
+	}
+	unsigned int block = DIR;
+	for (int b = 0; b < blocks; b++) {
+		fs->dir[b]->number = numbers[b] = block;
+		buffs[b] = (char *)fs->dir[b]->items;
+		ds_set_class(fs->disk, block, 1, DS_CLASS_DIR);
+		block = fat_get(fs, block);
+	}
+	ds_readv(fs->disk, numbers, buffs, blocks);
+	free(numbers);
+	free(buffs);
+	return 0;
+}
+
+// Copies the used entries of a directory block of an older format version
+// into the in-memory directory from entry slot on, or only counts them if
+// copy is 0. Returns the entry after the last one.
+static int dir_upgrade_block(fat_fs *fs, int version, char *buff, int slot, int copy){
+	if (version == 0) {
+		old_dir_item *old = (old_dir_item *)buff;
+		for (int i = 0; i < OLD_ITEMS; i++) {
+			if (!old[i].used) continue;
+			if (copy) {
+				dir_item *item = entry(fs, slot);
+				item->used = 1;
+				memcpy(item->name, old[i].name, OLD_LETTERS);
+				item->length = old[i].length;
+				item->first = old[i].first;
+			}
+			slot++;
+		}
+	} else {
+		v1_dir_item *old = (v1_dir_item *)buff;
+		for (int i = 0; i < V1_ITEMS; i++) {
+			if (!old[i].used) continue;
+			if (copy) {
+				dir_item *item = entry(fs, slot);
+				item->used = 1;
+				memcpy(item->name, old[i].name, MAX_LETTERS + 1);
+				item->length = old[i].length;
+				item->first = old[i].first;
 			}
-			printf("\n");
+			slot++;
 		}
 	}
+	return slot;
+}
 
-	free(aux_fat);
+// Upgrades an image of an older format version: version 0 has one block
+// of 6-letter entries, and version 1 a chain of entries with 32-bit
+// lengths. Used entries are packed into as many blocks as they need; the
+// blocks of the old directory are reused in chain order, starting at DIR,
+// and any others come from the allocator.
+static int dir_upgrade(fat_fs *fs){
+	int version = fs->sb.version;
+	int old_blocks = version == 0 ? 1 : dir_chain_length(fs);
+	unsigned int *chain = malloc(old_blocks * sizeof(unsigned int));
+	char *old = malloc((size_t)old_blocks * BLOCK_SIZE);
+	if (!chain || !old) {
+		free(chain);
+		free(old);
+		errno = ENOMEM;
+		return -1;
+	}
+	unsigned int block = DIR;
+	for (int b = 0; b < old_blocks; b++) {
+		chain[b] = block;
+		ds_read(fs->disk, block, old + (size_t)b * BLOCK_SIZE);
+		block = fat_get(fs, block);
+	}
+
+	int used = 0;
+	for (int b = 0; b < old_blocks; b++)
+		used = dir_upgrade_block(fs, version, old + (size_t)b * BLOCK_SIZE, used, 0);
+	int blocks = used > N_ITEMS ? (used + N_ITEMS - 1) / N_ITEMS : 1;
+	if (blocks < old_blocks) blocks = old_blocks;
+	int result = dir_alloc(fs, blocks);
+	int slot = 0;
+	for (int b = 0; result == 0 && b < old_blocks; b++)
+		slot = dir_upgrade_block(fs, version, old + (size_t)b * BLOCK_SIZE, slot, 1);
+
+	for (int b = 0; result == 0 && b < fs->n_dir_blocks; b++) {
+		if (b < old_blocks) {
+			fs->dir[b]->number = chain[b];
+		} else {
+			int block = alloc_get(&fs->alloc);
+			if (block == -1) {
+				errno = ENOSPC;
+				result = -1;
+				break;
+			}
+			fs->dir[b]->number = block;
+			fat_set(fs, fs->dir[b - 1]->number, block);
+		}
+		ds_set_class(fs->disk, fs->dir[b]->number, 1, DS_CLASS_DIR);
+	}
+	free(chain);
+	free(old);
+	if (result < 0) return -1;
+	fat_set(fs, fs->dir[fs->n_dir_blocks - 1]->number, EOFF);
+
+	// new blocks and FAT first, then the old blocks and the version
+	for (int b = fs->n_dir_blocks - 1; b >= 0; b--)
+		ds_write(fs->disk, fs->dir[b]->number, (char *)fs->dir[b]->items);
+	fat_sync(fs);
+	fs->sb.version = FS_VERSION;
+	ds_write(fs->disk, SUPER, (char *)&fs->sb);
+	return 0;
+}
+
+// Creates an unmounted file system on a disk opened with ds_init
+fat_fs *fat_new(ds_disk *disk){
+	fat_fs *fs = calloc(1, sizeof(fat_fs));
+	if (!fs) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	fs->disk = disk;
+	fs->free_entry = -1;
+	fs->index_enabled = 1;
+	pthread_mutex_init(&fs->dir_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_cond_init(&fs->scan_done, NULL);
+	return fs;
+}
+
+// Loads the FAT on demand from the next mount on, keeping at most `pages`
+// of its blocks in memory, or loads it whole at mount time if pages is 0,
+// the default. Fails with EBUSY if the file system is mounted.
+int fat_set_lazy(fat_fs *fs, int pages){
+	if (fs->mountState) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (pages < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	fs->fat_budget = pages;
+	return 0;
+}
+
+// Releases the FAT in memory
+static void fat_drop(fat_fs *fs){
+	free(fs->fat);
+	free(fs->fat_dirty);
+	fs->fat = NULL;
+	fs->fat_dirty = NULL;
+	fatcache_destroy(&fs->fat_pages);
+}
+
+// Releases a file system and its in-memory state. Buffered file data is
+// written first; the disk stays open.
+void fat_free(fat_fs *fs){
+	if (!fs) return;
+	if (fs->mountState) {
+		fat_flush(fs);
+		if (fs->has_scanner) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			fs->scan_stop = 1;
+			pthread_mutex_unlock(&fs->alloc_lock);
+			pthread_join(fs->scanner, NULL);
+		}
+		dir_free(fs);
+		fat_drop(fs);
+		alloc_destroy(&fs->alloc);
+	}
+	pthread_mutex_destroy(&fs->dir_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_cond_destroy(&fs->scan_done);
+	free(fs);
+}
+
+// Gives the free blocks of the FAT to the allocator, one FAT block at a
+// time, reading the blocks not in memory without loading them. Returns -1
+// if stopped by fat_free before the end.
+static int scan_fat(fat_fs *fs){
+	char entries[BLOCK_SIZE];
+	int per_block = FAT_ENTRIES(fs->sb.fat_width);
+	const fat_entry_access *access = fat_entries(fs->sb.fat_width);
+	for (int i = 0; i < fs->sb.n_fat_blocks; i++) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		if (fs->scan_stop) {
+			pthread_mutex_unlock(&fs->alloc_lock);
+			return -1;
+		}
+		fatcache_read(&fs->fat_pages, i, entries);
+		for (int k = 0; k < per_block; k++) {
+			if (access->get(entries, k) != FREE) continue;
+			int start = k;
+			while (k + 1 < per_block && access->get(entries, k + 1) == FREE) k++;
+			alloc_release_run(&fs->alloc, i * per_block + start, k - start + 1);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	return 0;
+}
+
+// Scanner thread started by fat_mount. Once done, the free count in the
+// superblock is brought up to date.
+static void *scanner_run(void *arg){
+	fat_fs *fs = arg;
+	if (scan_fat(fs) < 0) return NULL; // scanning stays set, so the count is not written
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->scanning = 0;
+	pthread_cond_broadcast(&fs->scan_done);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	fat_sync(fs);
+	return NULL;
 }
 
 // Mounts the file system  
-int fat_mount(){
-	if(mountState == 1){ //testa se ja estiver montado, se tiver vai dar falha na montagem
+int fat_mount(fat_fs *fs){
+	if(fs->mountState == 1){ //testa se ja estiver montado, se tiver vai dar falha na montagem
 		errno = EBUSY;
 		return -1;
 	}
   	// read superblock
-	ds_read(SUPER, (char*) &sb);
-	if (sb.magic == MAGIC_N) {
-		// bring FAT to memory
-		fat = malloc(sizeof(unsigned int) * sb.number_blocks);
-		for (int i = 0; i < sb.n_fat_blocks; i++) {
-			ds_read(TABLE + i, (char*) (fat + i * BLOCK_SIZE / sizeof(unsigned int)));
+	ds_set_class(fs->disk, SUPER, 1, DS_CLASS_SUPER);
+	ds_read(fs->disk, SUPER, (char*) &fs->sb);
+	if (fs->sb.version < 3) fs->sb.fat_width = 4; // older images have 4-byte entries
+	if (fs->sb.magic == MAGIC_N && fs->sb.version <= FS_VERSION
+	    && (fs->sb.fat_width == 2 || fs->sb.fat_width == 4)) {
+		int upgrade = fs->sb.version < 2; // the directory has an older format
+		classify(fs);
+		if (fs->fat_budget) {
+			// FAT blocks are read as they are needed
+			if (fatcache_init(&fs->fat_pages, fs->disk, TABLE, fs->sb.n_fat_blocks,
+			                  fs->sb.fat_width, fs->fat_budget) < 0)
+				return -1;
+		} else {
+			// bring FAT to memory (whole blocks, since it is read block by block)
+			fs->fat = malloc((size_t)fs->sb.n_fat_blocks * BLOCK_SIZE);
+			fs->fat_dirty = calloc(fs->sb.n_fat_blocks, 1);
+			if (!fs->fat || !fs->fat_dirty) {
+				fat_drop(fs);
+				errno = ENOMEM;
+				return -1;
+			}
+			for (int i = 0; i < fs->sb.n_fat_blocks; i++) {
+				ds_read(fs->disk, TABLE + i, fs->fat + (size_t)i * BLOCK_SIZE);
+			}
 		}
+		fat_access(fs);
 
-		// bring DIR to memory
-		ds_read(DIR, (char*) dir);
+		// build the free block bitmap from the FAT; when it is loaded on
+		// demand, the scanner does it after the mount, unless the directory
+		// must be upgraded first
+		if (alloc_init(&fs->alloc, fs->sb.number_blocks, TABLE + fs->sb.n_fat_blocks) < 0) {
+			fat_drop(fs);
+			return -1;
+		}
+		if (fs->fat) {
+			for (int i = TABLE + fs->sb.n_fat_blocks; i < fs->sb.number_blocks; i++) {
+				if (fat_get(fs, i) != FREE) continue;
+				int start = i;
+				while (i + 1 < fs->sb.number_blocks && fat_get(fs, i + 1) == FREE) i++;
+				alloc_release_run(&fs->alloc, start, i - start + 1);
+			}
+		} else if (upgrade) {
+			scan_fat(fs);
+		}
+
+		// bring the directory to memory and index it by name
+		if ((upgrade ? dir_upgrade(fs) : dir_load(fs)) < 0
+		    || dir_index_build(fs, fs->n_entries) < 0) {
+			dir_free(fs);
+			fat_drop(fs);
+			alloc_destroy(&fs->alloc);
+			return -1;
+		}
+		// a version 2 image only lacks the FAT entry width, always 4 bytes
+		if (fs->sb.version < FS_VERSION) {
+			fs->sb.version = FS_VERSION;
+			ds_write(fs->disk, SUPER, (char *)&fs->sb);
+		}
 		// filesystem mounted successfully
-		mountState = 1;
+		fs->mountState = 1;
+		fs->scan_stop = 0;
+		fs->has_scanner = 0;
+		if (!fs->fat && !upgrade) {
+			fs->scanning = 1;
+			fs->has_scanner = !pthread_create(&fs->scanner, NULL, scanner_run, fs);
+			if (!fs->has_scanner) {
+				fs->scanning = 0;
+				scan_fat(fs);
+			}
+		}
+		// images written before the free count existed are fixed up here
+		fat_sync(fs);
 		return 0;
 	} else {
 		errno = EINVAL;
@@ -175,9 +1067,12 @@ int fat_mount(){
 }
 
 // Creates a new file in the file system  
-int fat_create(char *name){
+int fat_create(fat_fs *fs, char *name){
+	TIMED(fs, FAT_OP_CREATE);
+	meta_writes = 0;
+
 	//Check if file system is mounted
-	if(!mountState) {
+	if(!fs->mountState) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -188,62 +1083,57 @@ int fat_create(char *name){
 		return -1;
 	}
 
-	// Check if file already exists
-	for(int i = 0; i < N_ITEMS; i++) {
-		if(dir[i].used && !strcmp(dir[i].name, name)) {
-			errno = EEXIST;
-			return -1;
-		}
-	}
+	pthread_mutex_lock(&fs->dir_lock);
 
-	// Find a free directory entry
-	int free_index = -1;
-	for(int i = 0; i < N_ITEMS; i++) {
-		if(!dir[i].used) {
-			free_index = i;
-			break;
-		}
-	}
-	if(free_index == -1) {
-		errno = ENOSPC; // No space left in directory
+	// Check if file already exists
+	if(dir_lookup(fs, name) != -1) {
+		pthread_mutex_unlock(&fs->dir_lock);
+		errno = EEXIST;
 		return -1;
 	}
-	// Find a free block in the FAT
-	int free_block = -1;
-	for(int i = TABLE + sb.n_fat_blocks; i < sb.number_blocks; i++) { 
-		if(fat[i] == FREE) {
-			free_block = i;
-			break;
-		}
-	}
-	if(free_block == -1) {
-		errno = ENOSPC; // No space left on disk
+
+	// Grow the directory by a block if it is full
+	if(fs->free_entry == -1 && dir_grow(fs) < 0) {
+		pthread_mutex_unlock(&fs->dir_lock);
 		return -1;
 	}
-
-	// Mark block as end of file in FAT
-	fat[free_block] = EOFF;
+	// No block is taken yet: the first write places the file where its
+	// data fits in a row
+	int free_index = dir_index_add(fs, name); // Take the free entry under this name
 
 	// Fill in the directory entry
-	dir[free_index].used = 1; // Mark entry as used
-	strncpy(dir[free_index].name, name, MAX_LETTERS); // Copy name
-	dir[free_index].name[MAX_LETTERS] = '\0'; // Null-terminate
-	dir[free_index].length = 0; // Initialize length to 0
-	dir[free_index].first = free_block; // Set first block
+	dir_item *item = entry(fs, free_index);
+	item->used = 1; // Mark entry as used
+	strncpy(item->name, name, MAX_LETTERS); // Copy name
+	item->name[MAX_LETTERS] = '\0'; // Null-terminate
+	item->length = 0; // Initialize length to 0
+	item->first = EOFF; // Empty file, no blocks
 	
-	// Write directory and FAT back to disk
-	ds_write(DIR, (char *)dir); // Write directory to disk
-	for (int i = 0; i < sb.n_fat_blocks; i++) {
-		ds_write(TABLE + i, (char *)(fat + i * BLOCK_SIZE / sizeof(unsigned int))); // Write FAT blocks to disk
-	}
+	// Write the directory block back to disk
+	dir_sync(fs, free_index);
+	pthread_mutex_unlock(&fs->dir_lock);
 	
 	return 0;
 }
 
+// Drops the buffered data of a file and the blocks promised to it. Called
+// with the file lock held exclusive and dir_lock held.
+static void wb_drop(fat_fs *fs, writeback *wb){
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->promised -= wb->promised;
+	fs->buffered -= wb->length;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	free(wb->data);
+	memset(wb, 0, sizeof(writeback));
+}
+
 // Deletes a file from the file system  
-int fat_delete( char *name){
+int fat_delete( fat_fs *fs, char *name){
+	TIMED(fs, FAT_OP_DELETE);
+	meta_writes = 0;
+
 	//Check if file system is mounted
-	if(!mountState) {
+	if(!fs->mountState) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -254,43 +1144,68 @@ int fat_delete( char *name){
 		return -1;
 	}
 
-	//procura o arquivo no diretorio
-	int arq_encontrado = -1;
-	for(int i = 0; i < N_ITEMS; i++) {
-		if(dir[i].used && strcmp(dir[i].name, name) == 0) {
-			arq_encontrado = i;
-			break;
+	//procura o arquivo no diretorio e espera as leituras e escritas nele
+	//terminarem; a trava do arquivo vem antes de dir_lock, entao a busca
+	//e refeita ate encontrar o mesmo arquivo depois de trava-lo
+	int arq_encontrado;
+	pthread_rwlock_t *lock;
+	while(1) {
+		pthread_mutex_lock(&fs->dir_lock);
+		arq_encontrado = dir_lookup(fs, name);
+		if(arq_encontrado == -1){
+			pthread_mutex_unlock(&fs->dir_lock);
+			errno = ENOENT;//arquivo não encontrado
+			return -1;
 		}
+		lock = &fs->dir[arq_encontrado / N_ITEMS]->lock[arq_encontrado % N_ITEMS];
+		pthread_mutex_unlock(&fs->dir_lock);
+
+		pthread_rwlock_wrlock(lock);
+		pthread_mutex_lock(&fs->dir_lock);
+		if(dir_lookup(fs, name) == arq_encontrado) break;
+		pthread_mutex_unlock(&fs->dir_lock);
+		pthread_rwlock_unlock(lock);
 	}
-	if(arq_encontrado == -1){
-		errno = ENOENT;//arquivo não encontrado
-		return -1;
-	}
+	dir_item *item = entry(fs, arq_encontrado);
 
 	//libera blocos da fat
-	unsigned int aux = dir[arq_encontrado].first;//começa no primeiro bloco do arquivo
-	while(aux != EOFF && aux < sb.number_blocks){
-		unsigned int prox = fat[aux];//pega o indica do proximo bloco do arquivo guardado no fat
-		fat[aux] = FREE;
+	pthread_mutex_lock(&fs->alloc_lock);
+	unsigned int aux = item->first;//começa no primeiro bloco do arquivo
+	while(aux != EOFF && aux < fs->sb.number_blocks){
+		unsigned int prox = fat_get(fs, aux);//pega o indica do proximo bloco do arquivo guardado no fat
+		fat_set(fs, aux, FREE);
+		alloc_release(&fs->alloc, aux);
 		aux = prox;//passa para o proximo bloco
 	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	//marca a entrada do diretorio como livre e descarta o indice de blocos
+	dir_index_remove(fs, arq_encontrado);
+	item->used = 0;
+	index_drop(&fs->dir[arq_encontrado / N_ITEMS]->index[arq_encontrado % N_ITEMS]);
+	memset(&fs->dir[arq_encontrado / N_ITEMS]->ra[arq_encontrado % N_ITEMS], 0, sizeof(readahead));
+	wb_drop(fs, &fs->dir[arq_encontrado / N_ITEMS]->wb[arq_encontrado % N_ITEMS]);
+
+	//fecha os descritores abertos para o arquivo removido
+	for(int fd = 0; fd < N_HANDLES; fd++) {
+		if(fs->handles[fd].used && fs->handles[fd].slot == arq_encontrado)
+			fs->handles[fd].used = 0;
+	}
 
-	//marca a entrada do diretorio como livre
-	dir[arq_encontrado].used = 0;
-
-	//escreve a fat e o diretorio no disco
+	//escreve os blocos alterados da fat e o diretorio no disco
 	//garante que as alteracoes na ram sejam feitas no disco tbm
-	for(int i = 0; i < sb.n_fat_blocks; i++){
-		ds_write(TABLE + i, (char *)(fat + i * BLOCK_SIZE / sizeof(unsigned int)));
-	}
+	fat_sync(fs);
 
-	ds_write(DIR, (char *)dir);
+	dir_sync(fs, arq_encontrado);
+	pthread_mutex_unlock(&fs->dir_lock);
+	pthread_rwlock_unlock(lock);
 
   	return 0;
 }
 
 // Gets the size of a file in bytes  
-int fat_getsize( char *name){ 
+long fat_getsize( fat_fs *fs, char *name){ 
+	TIMED(fs, FAT_OP_GETSIZE);
 	// Check for valid name
 	if(!name || strlen(name) > MAX_LETTERS) {
 		errno = EINVAL;
@@ -298,32 +1213,218 @@ int fat_getsize( char *name){
 	}
 
 	//Check if file system is mounted
-	if(!mountState) {
+	if(!fs->mountState) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	//procura o arquivo no diretorio
-	int arq_encontrado = -1;
-	for(int i = 0; i < N_ITEMS; i++) {
-		if(dir[i].used && strcmp(dir[i].name, name) == 0) {
-			arq_encontrado = i;
-			break;
-		}
-	}
+	pthread_mutex_lock(&fs->dir_lock);
+	int arq_encontrado = dir_lookup(fs, name);
 	if(arq_encontrado == -1){
+		pthread_mutex_unlock(&fs->dir_lock);
 		errno = ENOENT;//arquivo não encontrado
 		return -1;
 	}
-	int size = dir[arq_encontrado].length;
+	long size = entry(fs, arq_encontrado)->length;
+	writeback *wb = &fs->dir[arq_encontrado / N_ITEMS]->wb[arq_encontrado % N_ITEMS];
+	if (wb->length) size = wb->start + wb->length; // dados ainda na memoria
+	pthread_mutex_unlock(&fs->dir_lock);
 	return size;
 }
 
-// Reads data from a file into a buffer  
-// Returns the number of bytes read
-int fat_read( char *name, char *buff, int length, int offset){//ASSIM A SÓ VAI UM BLOCO (4096) BYTES
+#define IO_BATCH 16 // Blocks kept in flight by fat_pread and fat_pwrite
+
+static const char zero_block[BLOCK_SIZE]; // Written over the blocks of a hole
+
+// Finds the open handle for a descriptor, or NULL with errno=EBADF
+static handle *get_handle(fat_fs *fs, int fd){
+	if (!fs->mountState || fd < 0 || fd >= N_HANDLES || !fs->handles[fd].used) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &fs->handles[fd];
+}
+
+// Finds the open handle for a descriptor and takes the lock of its file,
+// shared or exclusive. Returns NULL with errno=EBADF if the descriptor is
+// not open or the file was deleted while waiting for the lock.
+static handle *lock_handle(fat_fs *fs, int fd, int exclusive){
+	handle *h = get_handle(fs, fd);
+	if (!h) return NULL;
+	pthread_rwlock_t *lock = h->lock;
+	if (exclusive) pthread_rwlock_wrlock(lock);
+	else pthread_rwlock_rdlock(lock);
+	if (!h->used || h->lock != lock) {
+		pthread_rwlock_unlock(lock);
+		errno = EBADF;
+		return NULL;
+	}
+	return h;
+}
+
+// lock_handle for reading: the buffered data of the file is written first,
+// so the reads find it on disk.
+static handle *lock_read(fat_fs *fs, int fd){
+	handle *h = lock_handle(fs, fd, 0);
+	if (!h || !h->wb->length) return h;
+	pthread_rwlock_unlock(h->lock);
+	if (fat_fsync(fs, fd) < 0) return NULL;
+	return lock_handle(fs, fd, 0);
+}
+
+// Returns the physical block holding logical block n of the open file.
+// The block index answers directly when it covers n; otherwise the chain is
+// walked from the end of the index, or from the handle cursor when it is
+// not past n. When the chain is shorter than n+1 blocks, EOFF is returned
+// if want is 0; otherwise the chain is grown in one go to want blocks (and
+// at least n+1), so the blocks a write is about to fill come in a row.
+// Called with the walk mutex of the file held.
+static unsigned int chain_walk(fat_fs *fs, handle *h, int n, int want){
+	dir_item *item = h->item;
+	block_index *ix = index_load(fs, h->index, item);
+	unsigned int current;
+	int i;
+	if (want && want < n + 1) want = n + 1;
+
+	if (ix && n < ix->count) {
+		current = ix->blocks[n];
+		i = n;
+	} else if (ix && ix->count > 0) {
+		current = ix->blocks[ix->count - 1];
+		i = ix->count - 1;
+	} else if (!ix && h->cur_logical >= 0 && h->cur_logical <= n) {
+		current = h->cur_block;
+		i = h->cur_logical;
+	} else {
+		current = item->first;
+		i = 0;
+		if (current == EOFF) {
+			if (!want) return EOFF;
+			int first = chain_append(fs, EOFF, want);
+			if (first == -1) return EOFF;
+			pthread_mutex_lock(&fs->dir_lock);
+			item->first = first;
+			pthread_mutex_unlock(&fs->dir_lock);
+			current = first;
+			if (ix && !index_append(ix, first)) ix = NULL;
+		}
+	}
+
+	while (i < n) {
+		if (current >= fs->sb.number_blocks) {
+			errno = EINVAL;
+			return EOFF;
+		}
+		if (fat_get(fs, current) == EOFF) {
+			if (!want) return EOFF;
+			// Aloca de uma vez os blocos que faltam ate want
+			if (chain_append(fs, current, want - i - 1) == -1) return EOFF;
+		}
+		current = fat_get(fs, current);
+		i++;
+		if (ix && i == ix->count && !index_append(ix, current)) ix = NULL;
+	}
+
+	h->cur_logical = n;
+	h->cur_block = current;
+	return current;
+}
+
+// Returns the number of blocks in the chain of a file, which may go past
+// its length after fat_reserve. Called with the file lock held.
+static int chain_count(fat_fs *fs, dir_item *item){
+	int count = 0;
+	for (unsigned int b = item->first; b != EOFF && b < fs->sb.number_blocks; b = fat_get(fs, b))
+		count++;
+	return count;
+}
+
+// chain_walk with the walk mutex of the file taken. Called with the file
+// lock held, exclusive if want is set.
+static unsigned int chain_block(fat_fs *fs, handle *h, int n, int want){
+	pthread_mutex_lock(h->walk);
+	unsigned int current = chain_walk(fs, h, n, want);
+	pthread_mutex_unlock(h->walk);
+	return current;
+}
+
+// Updates the readahead state after a read of logical blocks first to
+// next-1 and prefetches the blocks of the window that are not prefetched
+// yet. block is the physical block of logical block next, or EOFF. Called
+// with the file lock held.
+static void read_ahead(fat_fs *fs, handle *h, int first, int next, unsigned int block){
+	readahead *ra = h->ra;
+	int numbers[RA_MAX];
+	int count = 0;
+
+	pthread_mutex_lock(h->walk);
+	// Reads smaller than a block continue in the block the last one ended in
+	if (first != ra->next && first != ra->next - 1) {
+		ra->window = 0;
+	} else if (ra->window == 0) {
+		ra->window = RA_MIN;
+		ra->end = next;
+	} else if (ra->end - next <= ra->window / 2 && ra->window < RA_MAX) {
+		ra->window *= 2;
+	}
+	ra->next = next;
+	if (ra->end < next) ra->end = next;
+
+	if (ra->window && ra->end - next <= ra->window / 2) {
+		// caminha ate o primeiro bloco ainda nao buscado
+		int logical = next;
+		while (logical < ra->end && block != EOFF && block < fs->sb.number_blocks) {
+			block = fat_get(fs, block);
+			logical++;
+		}
+		while (logical < next + ra->window && block != EOFF && block < fs->sb.number_blocks) {
+			numbers[count++] = block;
+			block = fat_get(fs, block);
+			logical++;
+		}
+		ra->end = logical;
+	}
+	pthread_mutex_unlock(h->walk);
+
+	ds_prefetch(fs->disk, numbers, count);
+}
+
+// Returns the readahead window of an open file, in blocks, or -1 with
+// errno=EBADF
+int fat_readahead(fat_fs *fs, int fd){
+	handle *h = lock_handle(fs, fd, 0);
+	if (!h) return -1;
+	pthread_mutex_lock(h->walk);
+	int window = h->ra->window;
+	pthread_mutex_unlock(h->walk);
+	pthread_rwlock_unlock(h->lock);
+	return window;
+}
+
+// Points a handle at the state of the file in a directory entry. Called
+// with dir_lock held.
+static void handle_bind(fat_fs *fs, handle *h, int slot){
+	dir_block *b = fs->dir[slot / N_ITEMS];
+	int k = slot % N_ITEMS;
+	h->used = 1;
+	h->slot = slot;
+	h->item = &b->items[k];
+	h->index = &b->index[k];
+	h->ra = &b->ra[k];
+	h->wb = &b->wb[k];
+	h->lock = &b->lock[k];
+	h->walk = &b->walk[k];
+	h->cur_logical = -1;
+}
+
+// Opens a file and returns a descriptor for fat_pread/fat_pwrite
+int fat_open( fat_fs *fs, char *name ){
+	TIMED(fs, FAT_OP_OPEN);
+	meta_writes = 0;
+
 	//Check if file system is mounted
-	if(!mountState) {
+	if(!fs->mountState) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -335,268 +1436,874 @@ int fat_read( char *name, char *buff, int length, int offset){//ASSIM A SÓ VAI
 	}
 
 	//procura o arquivo no diretorio
-	int arq_encontrado = -1;
-	for(int i = 0; i < N_ITEMS; i++) {
-		if(dir[i].used && strcmp(dir[i].name, name) == 0) {
-			arq_encontrado = i;
-			break;
-		}
-	}
+	pthread_mutex_lock(&fs->dir_lock);
+	int arq_encontrado = dir_lookup(fs, name);
 	if(arq_encontrado == -1){
+		pthread_mutex_unlock(&fs->dir_lock);
 		errno = ENOENT;//arquivo não encontrado
 		return -1;
 	}
 
-	if (offset >= dir[arq_encontrado].length) {
+	for (int fd = 0; fd < N_HANDLES; fd++) {
+		if (!fs->handles[fd].used) {
+			handle_bind(fs, &fs->handles[fd], arq_encontrado);
+			pthread_mutex_unlock(&fs->dir_lock);
+			return fd;
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	errno = EMFILE;
+	return -1;
+}
+
+// Releases a descriptor, leaving the buffered data of the file in memory
+static int handle_close(fat_fs *fs, int fd){
+	pthread_mutex_lock(&fs->dir_lock);
+	handle *h = get_handle(fs, fd);
+	if (h) h->used = 0;
+	pthread_mutex_unlock(&fs->dir_lock);
+	return h ? 0 : -1;
+}
+
+// Closes a descriptor returned by fat_open, writing the buffered data of
+// the file first
+int fat_close( fat_fs *fs, int fd ){
+	TIMED(fs, FAT_OP_CLOSE);
+	int result = fat_fsync(fs, fd);
+	if (handle_close(fs, fd) < 0) return -1;
+	return result;
+}
+
+// Reads data from an open file into a buffer  
+// Returns the number of bytes read
+int fat_pread( fat_fs *fs, int fd, char *buff, int length, long offset ){
+	TIMED(fs, FAT_OP_PREAD);
+	meta_writes = 0;
+
+	handle *h = lock_read(fs, fd);
+	if (!h) return -1;
+	dir_item *item = h->item;
+
+	if (offset < 0 || offset >= item->length) {
+		pthread_rwlock_unlock(h->lock);
     	errno = EINVAL;
     	return -1;
 	}
 
 	//ver se não vai passar do offset
 	int readable;
-	if (offset + length > dir[arq_encontrado].length) {
-		readable = dir[arq_encontrado].length - offset;
+	if (offset + length > item->length) {
+		readable = item->length - offset;
 	} else {
 		readable = length;
 	}
 
-	// Cria fat temporária
-    unsigned int *fat_temp = (unsigned int *) malloc(sb.n_fat_blocks * BLOCK_SIZE);
-    if (!fat_temp) {
-        errno = ENOMEM;
-        return -1;
-    }
+	// a cadeia e seguida pela fat montada; com fat_set_lazy, as paginas da
+	// fat que nao estao na memoria sao lidas do disco
+	int logical = offset / BLOCK_SIZE; // bloco logico do offset
+	int block_offset = offset % BLOCK_SIZE; // offset para leitura
+	unsigned int current = chain_block(fs, h, logical, 0); // bloco atual
+	if (current == EOFF) {
+		pthread_rwlock_unlock(h->lock);
+		return 0; // offset maior que o arquivo
+	}
 
-	// ler blocos da fat temporária
-    for (int i = 0; i < sb.n_fat_blocks; i++) {
-        ds_read(TABLE + i, ((char*)fat_temp) + i * BLOCK_SIZE);
-    }
+	int bytes_read = 0;
+	char temp_block[IO_BATCH][BLOCK_SIZE];
+	char *block[IO_BATCH];
+	int start[IO_BATCH], bytes_to_copy[IO_BATCH];
+	int numbers[IO_BATCH];
+	char *buffs[IO_BATCH];
+
+	// ler os blocos em lotes: blocos consecutivos no disco viram uma so
+	// leitura, e todas as leituras do lote ficam em andamento ao mesmo tempo.
+	// Blocos inteiros sao lidos direto no buffer do chamador; so as pontas
+	// parciais passam por temp_block
+	while (bytes_read < readable && current != EOFF && current < fs->sb.number_blocks) {
+		int n = 0, pending = 0;
+		int batch_bytes = bytes_read;
+		int cursor_logical = logical;
+		unsigned int cursor_block = current;
+		while (n < IO_BATCH && batch_bytes < readable && current != EOFF && current < fs->sb.number_blocks) {
+			cursor_logical = logical;
+			cursor_block = current;
+
+			if (batch_bytes == 0) {
+				start[n] = block_offset;
+			} else {
+				start[n] = 0;
+			}
 
+			// bytes para copiar deste bloco
+			int block_remaining = BLOCK_SIZE - start[n];
+			if (readable - batch_bytes < block_remaining) {
+				bytes_to_copy[n] = readable - batch_bytes;
+			} else {
+				bytes_to_copy[n] = block_remaining;
+			}
 
-	unsigned int current = dir[arq_encontrado].first; // bloco atual
-	int skip_blocks = offset / BLOCK_SIZE; // blocos para pular
-	int block_offset = offset % BLOCK_SIZE; // offset para leitura
-	
+			// com o disco mapeado, copia direto do mapeamento
+			block[n] = ds_block_ptr(fs->disk, current);
+			if (!block[n]) {
+				numbers[pending] = current;
+				if (bytes_to_copy[n] == BLOCK_SIZE) {
+					buffs[pending++] = buff + batch_bytes; // sem copia intermediaria
+				} else {
+					buffs[pending++] = temp_block[n];
+					block[n] = temp_block[n];
+				}
+			}
+			batch_bytes += bytes_to_copy[n];
 
-	// ir para o offset
-	for (int i = 0; i < skip_blocks; i++) {
-		if (current == EOFF || current >= sb.number_blocks) {
-			free(fat_temp);
-			return 0; // offset maior que o arquivo
+			current = fat_get(fs, current); // Próximo bloco
+			logical++;
+			n++;
+		}
+		pthread_mutex_lock(h->walk);
+		h->cur_logical = cursor_logical;
+		h->cur_block = cursor_block;
+		pthread_mutex_unlock(h->walk);
+		ds_readv(fs->disk, numbers, buffs, pending);
+
+		// copiar o que nao foi lido direto no buffer
+		for (int i = 0; i < n; i++) {
+			if (block[i])
+				memcpy(buff + bytes_read, block[i] + start[i], bytes_to_copy[i]);
+			bytes_read += bytes_to_copy[i];
 		}
-		current = fat_temp[current];
 	}
+	read_ahead(fs, h, offset / BLOCK_SIZE, logical, current);
+	pthread_rwlock_unlock(h->lock);
+	return bytes_read;
+}
 
-	int bytes_read = 0;
-	char temp_block[BLOCK_SIZE];
+#define VIEW_MAX_BLOCKS 256 // Longest run returned by fat_pread_view
 
-	// ler os blocos
-	while (bytes_read < readable && current != EOFF && current < sb.number_blocks) {
-		ds_read(current, temp_block); // Lê bloco atual
+// Returns in *view a pointer into the mapped disk where the file data at
+// offset can be read in place, and the number of bytes readable there: up
+// to the end of the physically contiguous run of blocks, the end of the
+// file or VIEW_MAX_BLOCKS blocks. The view is only valid until the next
+// write or delete. Fails with ENOTSUP unless the disk backend is DS_MMAP.
+int fat_pread_view( fat_fs *fs, int fd, long offset, const char **view ){
+	TIMED(fs, FAT_OP_VIEW);
+	meta_writes = 0;
 
-		int start;
-		if (bytes_read == 0) {
-			start = block_offset;
-		} else {
-			start = 0;
-		}
-
-		int block_remaining = BLOCK_SIZE - start;
+	handle *h = lock_read(fs, fd);
+	if (!h) return -1;
+	dir_item *item = h->item;
 
-		// blocos para copiar
-		int bytes_to_copy;
-		if (readable - bytes_read < block_remaining) {
-			bytes_to_copy = readable - bytes_read;
-		} else {
-			bytes_to_copy = block_remaining;
-		}
+	if (!view || offset < 0 || offset >= item->length) {
+		pthread_rwlock_unlock(h->lock);
+		errno = EINVAL;
+		return -1;
+	}
 
-		// copiar
-		memcpy(buff + bytes_read, temp_block + start, bytes_to_copy);
-		bytes_read += bytes_to_copy;
+	int logical = offset / BLOCK_SIZE;
+	unsigned int current = chain_block(fs, h, logical, 0);
+	if (current == EOFF) {
+		pthread_rwlock_unlock(h->lock);
+		return 0; // offset maior que o arquivo
+	}
+	char *first = ds_block_ptr(fs->disk, current);
+	if (!first) {
+		pthread_rwlock_unlock(h->lock);
+		errno = ENOTSUP;
+		return -1;
+	}
 
-		current = fat_temp[current]; // Próximo bloco
+	// estende a visao enquanto os proximos blocos estiverem logo em seguida no disco
+	int blocks = 1;
+	int available = BLOCK_SIZE - offset % BLOCK_SIZE;
+	while (blocks < VIEW_MAX_BLOCKS && offset + available < item->length &&
+	       fat_get(fs, current) == current + 1) {
+		current = fat_get(fs, current);
+		ds_block_ptr(fs->disk, current);
+		logical++;
+		available += BLOCK_SIZE;
+		blocks++;
 	}
-	free(fat_temp);
-	return bytes_read;
+	if (offset + available > item->length)
+		available = item->length - offset;
+	pthread_mutex_lock(h->walk);
+	h->cur_logical = logical;
+	h->cur_block = current;
+	pthread_mutex_unlock(h->walk);
+	pthread_rwlock_unlock(h->lock);
+
+	*view = first + offset % BLOCK_SIZE;
+	return available;
+}
+
+// Number of blocks a file needs beyond its chain to hold its first end
+// bytes. The chain has one block per BLOCK_SIZE of the length, and at least
+// one if the file has any; blocks reserved past the length are not counted.
+static int blocks_needed(dir_item *item, long end){
+    int total_needed = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int already_allocated = (item->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (already_allocated == 0 && item->first != EOFF)
+        already_allocated = 1;
+    return total_needed > already_allocated ? total_needed - already_allocated : 0;
 }
 
-// Writes data from a buffer to a file  
+// Writes data from a buffer to an open file, allocating its blocks. Called
+// with the file lock held exclusive and length > 0.
 // Returns the number of bytes written
-int fat_write(char *name, const char *buff, int length, int offset) {
-    if (!mountState || !name || strlen(name) > MAX_LETTERS || offset < 0) {
-        errno = EINVAL;
+static int file_write( fat_fs *fs, handle *h, const char *buff, int length, long offset ){
+    dir_item *item = h->item;
+
+	// a fat montada e alterada com fat_set (com fat_set_lazy, nas paginas
+	// carregadas); so os blocos sujos vao para o disco no fat_sync
+	dir_item old_item = *item;
+
+    int writable = length;
+
+    // Verificar se há blocos suficientes disponíveis; os blocos prometidos
+    // aos dados de outros arquivos ainda na memoria nao contam
+    int total_needed = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int new_blocks_needed = blocks_needed(item, offset + length);
+    pthread_mutex_lock(&fs->alloc_lock);
+    int free_blocks = free_space(fs, h->wb->promised, new_blocks_needed);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    // blocos reservados com fat_reserve passam do tamanho; so nesse caso
+    // vale a pena contar a cadeia
+    if (free_blocks < new_blocks_needed)
+        new_blocks_needed = total_needed - chain_count(fs, item);
+    if (free_blocks < new_blocks_needed) {
+        errno = ENOSPC;
         return -1;
     }
 
-    // Procurar o arquivo no diretório
-    int arq_encontrado = -1;
-    for (int i = 0; i < N_ITEMS; i++) {
-        if (dir[i].used && strcmp(dir[i].name, name) == 0) {
-            arq_encontrado = i;
-            break;
+    // Blocos entre o fim antigo e o offset (um buraco) sao zerados em lotes:
+    // alocados agora ou reservados antes, ainda tem dados de outro arquivo
+    int logical = offset / BLOCK_SIZE;
+    long old_length = item->length;
+    int hole = (old_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int block[IO_BATCH];
+    const char *zeros[IO_BATCH];
+    while (hole < logical) {
+        int n = 0;
+        while (n < IO_BATCH && hole < logical) {
+            unsigned int b = chain_block(fs, h, hole++, total_needed);
+            if (b == EOFF) {
+                fat_sync(fs);
+                return -1;
+            }
+            block[n] = b;
+            zeros[n++] = zero_block;
         }
+        ds_writev(fs->disk, block, zeros, n);
     }
 
-    if (arq_encontrado == -1) {
-        errno = ENOENT;
+    // Caminhar até o bloco de início do offset, alocando se necessário
+    unsigned int current = chain_block(fs, h, logical, total_needed);
+    if (current == EOFF) {
+        fat_sync(fs);
         return -1;
     }
 
-	//ponteiro temporario pra fat
-	unsigned int *fat_temp = (unsigned int *) malloc(sb.n_fat_blocks * BLOCK_SIZE);
-	if (!fat_temp) {
-		errno = ENOMEM;
-		return -1;
-	}
+    // Escrita nos blocos, em lotes: as leituras do lote ficam em andamento
+    // ao mesmo tempo, depois as escritas. So e preciso ler um bloco se a
+    // parte dele que nao sera escrita ainda tem dados do arquivo; blocos
+    // inteiros vao direto do buffer do chamador para o disco
+    int bytes_written = 0;
+    int block_offset = offset % BLOCK_SIZE;
+    char temp_block[IO_BATCH][BLOCK_SIZE];
+    int rblock[IO_BATCH];
+    char *buffs[IO_BATCH], *rbuffs[IO_BATCH];
+    int start[IO_BATCH], to_copy[IO_BATCH];
 
-	// ler para a fat temporária
-	for (int i = 0; i < sb.n_fat_blocks; i++) {
-		ds_read(TABLE + i, ((char *)fat_temp) + i * BLOCK_SIZE);
-	}
+	// continua escrevendo enquanto ainda tiver espaço para escrita
+    while (bytes_written < writable && current != EOFF) {
+        int n = 0, reads = 0;
+        int batch_bytes = bytes_written;
+        while (n < IO_BATCH && batch_bytes < writable) {
+            if (n > 0 || batch_bytes > 0) {
+                current = chain_block(fs, h, ++logical, total_needed);
+                if (current == EOFF) {
+                    break;  // parcial, não foi possível escrever todos os blocos
+                }
+            }
+            block[n] = current;
 
-    int data_start = TABLE + sb.n_fat_blocks;
-    int writable = length;
+            if (batch_bytes == 0) {
+                start[n] = block_offset;
+            } else {
+                start[n] = 0;
+            }
 
-    // Verificar se há blocos suficientes disponíveis
-    unsigned int current = dir[arq_encontrado].first;
-    int total_needed = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int already_allocated = 0;
+            int space = BLOCK_SIZE - start[n];
+            if (writable - batch_bytes < space) {
+                to_copy[n] = writable - batch_bytes;
+            } else {
+                to_copy[n] = space;
+            }
 
-    unsigned int temp = current;
-	while (temp != EOFF) {
-		if (temp >= sb.number_blocks) {
-			errno = EINVAL;
-			return -1;
-		}
-		already_allocated++;
-		temp = fat_temp[temp];
-	}
+            // dados antigos antes ou depois do trecho escrito neste bloco
+            long block_pos = (long)logical * BLOCK_SIZE;
+            int old_head = start[n] > 0 && block_pos < old_length;
+            int old_tail = start[n] + to_copy[n] < BLOCK_SIZE &&
+                           block_pos + start[n] + to_copy[n] < old_length;
+
+            if (to_copy[n] == BLOCK_SIZE) {
+                buffs[n] = (char *)buff + batch_bytes; // sem copia intermediaria
+            } else {
+                buffs[n] = temp_block[n];
+                if (old_head || old_tail) {
+                    rblock[reads] = current;
+                    rbuffs[reads++] = temp_block[n];
+                } else {
+                    memset(temp_block[n], 0, BLOCK_SIZE); // bloco novo ou alem do fim do arquivo
+                }
+            }
+            batch_bytes += to_copy[n];
+            n++;
+        }
+        // blocos consecutivos no disco sao lidos e escritos de uma vez
+        ds_readv(fs->disk, rblock, rbuffs, reads);
 
+        for (int i = 0; i < n; i++) {
+            if (buffs[i] == temp_block[i])
+                memcpy(temp_block[i] + start[i], buff + bytes_written, to_copy[i]);
+            bytes_written += to_copy[i];
+        }
+        ds_writev(fs->disk, block, (const char *const *)buffs, n);
+    }
 
-    int new_blocks_needed = total_needed - already_allocated;
-    int free_blocks = 0;
-    for (int i = data_start; i < sb.number_blocks; i++) {
-        if (fat_temp[i] == 0)
-            free_blocks++;
+	fat_sync(fs); // Salva apenas os blocos alterados da fat
+
+    // Atualizar tamanho do arquivo, se necessário, e salvar o diretório de
+    // volta no disco se a entrada mudou
+	pthread_mutex_lock(&fs->dir_lock);
+    if (offset + bytes_written > item->length) {
+        item->length = offset + bytes_written;
     }
+	if (memcmp(&old_item, item, sizeof(dir_item)))
+		dir_sync(fs, h->slot);
+	pthread_mutex_unlock(&fs->dir_lock);
 
-    if (free_blocks < new_blocks_needed) {
-        errno = ENOSPC;
+    return bytes_written;
+}
+
+// Writes the buffered data of an open file, with its blocks allocated
+// together, in one extent when the free space allows. The data is dropped
+// even if not all of it could be written. Returns 0, or -1 with errno set.
+// Called with the file lock held exclusive.
+static int write_flush(fat_fs *fs, handle *h){
+	writeback *wb = h->wb;
+	if (!wb->length) return 0;
+	int written = file_write(fs, h, wb->data, wb->length, wb->start);
+	int result = 0;
+	if (written != wb->length) {
+		if (written >= 0) errno = ENOSPC;
+		result = -1;
+	}
+	pthread_mutex_lock(&fs->dir_lock);
+	wb_drop(fs, wb);
+	pthread_mutex_unlock(&fs->dir_lock);
+	return result;
+}
+
+// Keeps an append to an open file in its buffer, in delayed allocation
+// mode. Returns 1 if the data was buffered, or 0 if it must be written now:
+// it does not start where the file and its buffered data end, it does not
+// fit in the buffers, or the free blocks could not hold it. Called with the
+// file lock held exclusive.
+static int write_delay(fat_fs *fs, handle *h, const char *buff, int length, long offset){
+	writeback *wb = h->wb;
+	if (length > DELALLOC_MAX) return 0;
+	if (wb->length + length > DELALLOC_MAX && write_flush(fs, h) < 0) return 0;
+	if (offset != (wb->length ? wb->start + wb->length : h->item->length)) return 0;
+
+	if (wb->length + length > wb->capacity) {
+		int capacity = wb->capacity ? wb->capacity : IO_BATCH * BLOCK_SIZE;
+		while (capacity < wb->length + length) capacity *= 2;
+		if (capacity > DELALLOC_MAX) capacity = DELALLOC_MAX;
+		char *data = realloc(wb->data, capacity);
+		if (!data) return 0;
+		wb->data = data;
+		wb->capacity = capacity;
+	}
+
+	// promete os blocos que os dados vao ocupar, se ainda houver livres
+	int need = blocks_needed(h->item, offset + length);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int ok = fs->buffered + length <= DELALLOC_TOTAL &&
+	         free_space(fs, wb->promised, need) >= need;
+	if (ok) {
+		fs->promised += need - wb->promised;
+		fs->buffered += length;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (!ok) return 0;
+
+	wb->promised = need;
+	memcpy(wb->data + wb->length, buff, length);
+	pthread_mutex_lock(&fs->dir_lock);
+	if (!wb->length) wb->start = offset;
+	wb->length += length;
+	pthread_mutex_unlock(&fs->dir_lock);
+	return 1;
+}
+
+// Writes data from a buffer to an open file  
+// Returns the number of bytes written
+int fat_pwrite( fat_fs *fs, int fd, const char *buff, int length, long offset ){
+    TIMED(fs, FAT_OP_PWRITE);
+    meta_writes = 0;
+
+    if (offset < 0 || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset > MAX_FILE_SIZE - length) {
+        errno = EFBIG;
         return -1;
     }
+    handle *h = lock_handle(fs, fd, 1);
+    if (!h) return -1;
+
+    // no modo de alocacao adiada, o que e acrescentado ao fim do arquivo
+    // fica na memoria; antes de qualquer outra escrita, os dados pendentes
+    // vao para o disco
+    int result = length;
+    if (length > 0 && !(fs->delalloc && write_delay(fs, h, buff, length, offset))) {
+        if (write_flush(fs, h) < 0)
+            result = -1;
+        else
+            result = file_write(fs, h, buff, length, offset);
+    }
+    pthread_rwlock_unlock(h->lock);
+    return result;
+}
 
-    // Alocar primeiro bloco se necessário
-	if (dir[arq_encontrado].first == EOFF) {
-		int first = -1;
-		for (int i = data_start; i < sb.number_blocks; i++) {
-			if (fat_temp[i] == 0) {
-				first = i;
-				fat_temp[i] = EOFF;
-				dir[arq_encontrado].first = first;
-				break;
-			}
+// Writes the buffered data of an open file to disk. Returns 0, or -1 with
+// errno set.
+int fat_fsync(fat_fs *fs, int fd){
+	TIMED(fs, FAT_OP_FSYNC);
+	meta_writes = 0;
+	handle *h = lock_handle(fs, fd, 1);
+	if (!h) return -1;
+	int result = write_flush(fs, h);
+	pthread_rwlock_unlock(h->lock);
+	return result;
+}
+
+// Writes the buffered data of every file to disk. Returns 0, or -1 with
+// errno set if some of it could not be written.
+int fat_flush(fat_fs *fs){
+	TIMED(fs, FAT_OP_FLUSH);
+	meta_writes = 0;
+	if (!fs->mountState) {
+		errno = EINVAL;
+		return -1;
+	}
+	int result = 0, error = 0;
+	pthread_mutex_lock(&fs->dir_lock);
+	int entries = fs->n_entries;
+	pthread_mutex_unlock(&fs->dir_lock);
+	for (int slot = 0; slot < entries; slot++) {
+		pthread_mutex_lock(&fs->dir_lock);
+		dir_block *b = fs->dir[slot / N_ITEMS];
+		int pending = b->wb[slot % N_ITEMS].length;
+		pthread_mutex_unlock(&fs->dir_lock);
+		if (!pending) continue;
+
+		handle h;
+		pthread_rwlock_wrlock(&b->lock[slot % N_ITEMS]);
+		pthread_mutex_lock(&fs->dir_lock);
+		handle_bind(fs, &h, slot);
+		pthread_mutex_unlock(&fs->dir_lock);
+		if (write_flush(fs, &h) < 0) {
+			error = errno;
+			result = -1;
 		}
-		if (first == -1) {
+		pthread_rwlock_unlock(&b->lock[slot % N_ITEMS]);
+	}
+	if (result) errno = error;
+	return result;
+}
+
+// Turns delayed allocation on or off. In this mode fat_pwrite keeps what is
+// appended to a file in memory, and its blocks are allocated when the data
+// is flushed: by fat_fsync, fat_close, fat_flush, a read of the file, or a
+// write elsewhere in it. Turning it off flushes every file.
+int fat_set_delalloc(fat_fs *fs, int enable){
+	fs->delalloc = enable;
+	if (!enable && fs->mountState) return fat_flush(fs);
+	return 0;
+}
+
+// Allocates the blocks for the first size bytes of an open file, as one
+// extent when the free space allows, without changing its length. Writes
+// up to size then find their blocks in a row. Blocks past the length stay
+// with the file until it is deleted. Returns 0, or -1 with errno set.
+int fat_reserve(fat_fs *fs, int fd, long size){
+	TIMED(fs, FAT_OP_RESERVE);
+	meta_writes = 0;
+
+	if (size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (size > MAX_FILE_SIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+	handle *h = lock_handle(fs, fd, 1);
+	if (!h) return -1;
+	dir_item *item = h->item;
+	dir_item old_item = *item;
+
+	int blocks = (int)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	int have = chain_count(fs, item);
+	int result = 0;
+	if (blocks > have) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		int free_blocks = free_space(fs, h->wb->promised, blocks - have);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (free_blocks < blocks - have) {
 			errno = ENOSPC;
-			return -1;
+			result = -1;
+		} else if (chain_block(fs, h, blocks - 1, blocks) == EOFF) {
+			result = -1;
 		}
-    	current = first;
+		fat_sync(fs);
 	}
 
+	pthread_mutex_lock(&fs->dir_lock);
+	if (memcmp(&old_item, item, sizeof(dir_item)))
+		dir_sync(fs, h->slot);
+	pthread_mutex_unlock(&fs->dir_lock);
+	pthread_rwlock_unlock(h->lock);
+	return result;
+}
 
-    // Caminhar até o bloco de início do offset
-    int skip = offset / BLOCK_SIZE;
-    for (int i = 0; i < skip; i++) {
-		if (current >= sb.number_blocks) {
-        	errno = EINVAL;
-        	return -1;
-    	}
-        if (fat_temp[current] == EOFF) {
-            // Aloca novo bloco
-            int novo = -1;
-            for (int j = data_start; j < sb.number_blocks; j++) {
-                if (fat_temp[j] == 0) {
-                    novo = j;
-                    break;
-                }
-            }
-            if (novo == -1) {
-                errno = ENOSPC;
-                return -1;
-            }
-            fat_temp[current] = novo;
-            fat_temp[novo] = EOFF;
-        }
-        current = fat_temp[current];
-    }
+// Measures the fragmentation of the files and of the free space
+int fat_fragmentation(fat_fs *fs, fat_frag *frag){
+	if (!fs->mountState) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(frag, 0, sizeof(*frag));
+
+	pthread_mutex_lock(&fs->dir_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	scan_wait(fs);
+	for (int slot = 0; slot < fs->n_entries; slot++) {
+		dir_item *item = entry(fs, slot);
+		if (!item->used || item->first == EOFF) continue;
+		int extents = 0, blocks = 0;
+		unsigned int prev = EOFF;
+		for (unsigned int b = item->first; b != EOFF && b < fs->sb.number_blocks && blocks < fs->sb.number_blocks; b = fat_get(fs, b)) {
+			if (prev == EOFF || b != prev + 1) extents++;
+			prev = b;
+			blocks++;
+		}
+		frag->files++;
+		frag->blocks += blocks;
+		frag->extents += extents;
+		if (extents > 1) frag->fragmented++;
+	}
+	frag->free_runs = alloc_free_runs(&fs->alloc, &frag->largest_free);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->dir_lock);
+	return 0;
+}
 
-    // Escrita nos blocos
-    int bytes_written = 0;
-    int block_offset = offset % BLOCK_SIZE;
-    char temp_block[BLOCK_SIZE];
+#define DEFRAG_BATCH 64     // Blocks of a chain placed at a time by fat_defrag
+#define DEFRAG_WINDOW 65536 // Blocks whose previous block fat_defrag keeps at a time
 
-	// continua escrevendo enquanto ainda tiver espaço para escrita
-    while (bytes_written < writable) {
-		if (current >= sb.number_blocks) {
-        	errno = EINVAL;
-        	return -1;
-    	}
-        ds_read(current, temp_block);
-
-        int start;
-		if (bytes_written == 0) {
-		    start = block_offset;
-		} else {
-		    start = 0;
+// State of fat_defrag. Blocks of other chains found where a chain is
+// placed must be linked again from their previous blocks, which are kept
+// for a window of blocks from d->next on and found again by walking the
+// chains not placed yet whenever the window moves on.
+typedef struct{
+	int *back;          // Previous block in the chain of each block of the window, -(slot+1) for the first block of a file, 0 if none
+	int base;           // First block of the window
+	int size;           // Blocks in the window
+	int capacity;       // Room in back
+	unsigned int (*files)[2]; // (first block, slot) of each file, in the order they are placed
+	int n_files;        // Entries in files
+	int current;        // File being placed, -1 for the directory
+	int next;           // Where the next block placed goes
+	int moved;          // Blocks moved so far
+	char *buff;         // Data of the blocks moved by one batch
+} defrag;
+
+// Returns the previous block of a block in the window
+static int back_get(defrag *d, int block){
+	if (block < d->base || block >= d->base + d->size) return 0;
+	return d->back[block - d->base];
+}
+
+// Records the previous block of a block, if it is in the window
+static void back_set(defrag *d, unsigned int block, int prev){
+	if (block >= (unsigned int)d->base && block < (unsigned int)(d->base + d->size))
+		d->back[block - d->base] = prev;
+}
+
+// Moves the window to d->next and finds the previous block of its blocks
+// in the chains of the directory, unless it is placed already, and of the
+// files from the one being placed on
+static void defrag_window(fat_fs *fs, defrag *d){
+	d->base = d->next;
+	d->size = fs->sb.number_blocks - d->base;
+	if (d->size > d->capacity) d->size = d->capacity;
+	memset(d->back, 0, d->size * sizeof(int));
+	if (d->current < 0) {
+		for (int k = 1; k < fs->n_dir_blocks; k++)
+			back_set(d, fs->dir[k]->number, fs->dir[k - 1]->number);
+	}
+	for (int i = d->current < 0 ? 0 : d->current; i < d->n_files; i++) {
+		int slot = d->files[i][1], blocks = 0;
+		unsigned int next;
+		back_set(d, entry(fs, slot)->first, -slot - 1);
+		for (unsigned int b = entry(fs, slot)->first; b != EOFF && b < fs->sb.number_blocks
+		     && (next = fat_get(fs, b)) != EOFF && next < fs->sb.number_blocks
+		     && blocks < fs->sb.number_blocks; b = next, blocks++)
+			back_set(d, next, b);
+	}
+}
+
+// Position of a block in a list, or -1
+static int find_block(const int *list, int count, int block){
+	for (int i = 0; i < count; i++)
+		if (list[i] == block) return i;
+	return -1;
+}
+
+// Moves the n blocks of a chain in src, given in chain order, to the n
+// blocks from d->next on; pred is the previous block of src[0], as in
+// d->back. Blocks of other chains found there go to the places the chain
+// leaves, so no free space is needed. The batch is read and then written
+// in one go each, so consecutive blocks move together.
+// Called with every file lock and dir_lock held.
+static void defrag_batch(fat_fs *fs, defrag *d, const int *src, int n, int pred){
+	int from[2 * DEFRAG_BATCH], to[2 * DEFRAG_BATCH];
+	int prev[2 * DEFRAG_BATCH], slots[2 * DEFRAG_BATCH];
+	unsigned int succ[2 * DEFRAG_BATCH];
+	char *buffs[2 * DEFRAG_BATCH];
+	int moves = 0, spare = 0, n_slots = 0;
+
+	for (int k = 0; k < n; k++) {
+		if (src[k] != d->next + k) {
+			prev[moves] = k ? src[k - 1] : pred;
+			from[moves] = src[k];
+			to[moves++] = d->next + k;
 		}
+	}
+	// os blocos de outras cadeias no caminho vao para os lugares que a
+	// cadeia deixa livres
+	for (int b = d->next; b < d->next + n; b++) {
+		if (fat_get(fs, b) == FREE || find_block(src, n, b) >= 0) continue;
+		while (src[spare] >= d->next && src[spare] < d->next + n) spare++;
+		prev[moves] = back_get(d, b);
+		from[moves] = b;
+		to[moves++] = src[spare++];
+	}
+	d->next += n;
+	if (!moves) return;
 
-        int space = BLOCK_SIZE - start;
-        int to_copy;
-		if (writable - bytes_written < space) {
-		    to_copy = writable - bytes_written;
+	for (int m = 0; m < moves; m++) {
+		buffs[m] = d->buff + m * BLOCK_SIZE;
+		succ[m] = fat_get(fs, from[m]);
+	}
+	ds_readv(fs->disk, from, buffs, moves);
+	ds_writev(fs->disk, to, (const char *const *)buffs, moves);
+
+	// refaz os encadeamentos com as posicoes novas
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int m = 0; m < moves; m++) {
+		if (find_block(to, moves, from[m]) < 0) alloc_release(&fs->alloc, from[m]);
+		alloc_take(&fs->alloc, to[m]);
+		fat_set(fs, from[m], FREE);
+	}
+	for (int m = 0; m < moves; m++) {
+		int i = find_block(from, moves, (int)succ[m]);
+		unsigned int next = succ[m] == EOFF ? EOFF : (i >= 0 ? (unsigned int)to[i] : succ[m]);
+		fat_set(fs, to[m], next);
+		if (next != EOFF) back_set(d, next, to[m]);
+		if (prev[m] < 0) {
+			entry(fs, -prev[m] - 1)->first = to[m];
+			slots[n_slots++] = -prev[m] - 1;
+			back_set(d, to[m], prev[m]);
+		} else if (prev[m] > 0) {
+			i = find_block(from, moves, prev[m]);
+			int p = i >= 0 ? to[i] : prev[m];
+			fat_set(fs, p, to[m]);
+			back_set(d, to[m], p);
 		} else {
-		    to_copy = space;
+			back_set(d, to[m], 0); // bloco perdido, fora de qualquer cadeia
 		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
 
-        memcpy(temp_block + start, buff + bytes_written, to_copy);
-        ds_write(current, temp_block);
+	for (int k = 1; k < fs->n_dir_blocks; k++) {
+		int i = find_block(from, moves, fs->dir[k]->number);
+		if (i >= 0) fs->dir[k]->number = to[i];
+	}
+	for (int m = 0; m < moves; m++)
+		ds_set_class(fs->disk, from[m], 1, DS_CLASS_DATA);
+	for (int k = 1; k < fs->n_dir_blocks; k++)
+		ds_set_class(fs->disk, fs->dir[k]->number, 1, DS_CLASS_DIR);
+	for (int i = 0; i < n_slots; i++)
+		dir_sync(fs, slots[i]);
+	d->moved += moves;
+}
 
-        bytes_written += to_copy;
+// Places a chain, from block `block` on, at d->next and the blocks after
+// it; pred is the previous block of `block`, as in d->back
+static void defrag_chain(fat_fs *fs, defrag *d, unsigned int block, int pred){
+	int src[DEFRAG_BATCH];
+	while (block != EOFF && block < fs->sb.number_blocks && d->next < fs->sb.number_blocks) {
+		int end = d->next + DEFRAG_BATCH;
+		if (end > fs->sb.number_blocks) end = fs->sb.number_blocks;
+		if (end > d->base + d->size) defrag_window(fs, d);
+		int n = 0;
+		while (block != EOFF && block < fs->sb.number_blocks && n < DEFRAG_BATCH && d->next + n < fs->sb.number_blocks) {
+			src[n++] = block;
+			block = fat_get(fs, block);
+		}
+		defrag_batch(fs, d, src, n, pred);
+		pred = d->next - 1;
+		block = fat_get(fs, pred);
+	}
+	fat_sync(fs);
+}
 
-        if (bytes_written < writable) {
-            if (fat_temp[current] == EOFF) {
-                int novo = -1;
-                for (int i = data_start; i < sb.number_blocks; i++) {
-                    if (fat_temp[i] == 0) {
-                        novo = i;
-                        break;
-                    }
-                }
-                if (novo == -1) {
-                    errno = ENOSPC;
-                    return bytes_written;  // parcial, não foi possível escrever todos os blocos
-                }
-                fat_temp[current] = novo;
-                fat_temp[novo] = EOFF;
-            }
-            current = fat_temp[current];
-        }
-    }
+// Orders files by the first block of their chains
+static int first_cmp(const void *a, const void *b){
+	unsigned int x = ((const unsigned int *)a)[0], y = ((const unsigned int *)b)[0];
+	return x < y ? -1 : x > y;
+}
 
-    // Atualizar tamanho do arquivo, se necessário
-    if (offset + bytes_written > dir[arq_encontrado].length) {
-        dir[arq_encontrado].length = offset + bytes_written;
-		
-    }
+// Places the directory and then each file, in the order the files start.
+// d->files has room for one (first block, slot) pair per directory entry.
+// Called with every file lock and dir_lock held.
+static void defrag_all(fat_fs *fs, defrag *d){
+	// os arquivos, na ordem do primeiro bloco
+	d->n_files = 0;
+	for (int slot = 0; slot < fs->n_entries; slot++) {
+		dir_item *item = entry(fs, slot);
+		if (!item->used || item->first == EOFF) continue;
+		d->files[d->n_files][0] = item->first;
+		d->files[d->n_files++][1] = slot;
+	}
+	qsort(d->files, d->n_files, sizeof(*d->files), first_cmp);
+
+	// os blocos se movem, entao os indices e os cursores dos arquivos
+	// deixam de valer
+	for (int slot = 0; slot < fs->n_entries; slot++)
+		index_drop(&fs->dir[slot / N_ITEMS]->index[slot % N_ITEMS]);
+	for (int fd = 0; fd < N_HANDLES; fd++)
+		fs->handles[fd].cur_logical = -1;
+
+	d->current = -1;
+	defrag_chain(fs, d, fat_get(fs, DIR), DIR);
+	for (d->current = 0; d->current < d->n_files; d->current++) {
+		int slot = d->files[d->current][1];
+		defrag_chain(fs, d, entry(fs, slot)->first, -slot - 1);
+	}
+}
 
-	for (int i = 0; i < sb.n_fat_blocks; i++) {
-		ds_write(TABLE + i, ((char*)fat_temp) + i * BLOCK_SIZE);
+// Rewrites the chains of the directory and of every file as runs of
+// consecutive blocks, packed from the start of the data area in the order
+// the files start, so the free space ends up in one run at the end of the
+// image. Blocks move in batches of DEFRAG_BATCH; besides them, memory goes
+// to one int per block of a window of DEFRAG_WINDOW blocks and to one pair
+// per file. Other operations wait while it runs.
+// Returns the number of blocks moved, or -1 with errno set.
+int fat_defrag(fat_fs *fs){
+	TIMED(fs, FAT_OP_DEFRAG);
+	meta_writes = 0;
+	if (!fs->mountState) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	ds_write(DIR, (char*) dir); // Salva o diretório de volta no disco
+	// os blocos livres precisam ser todos conhecidos
+	pthread_mutex_lock(&fs->alloc_lock);
+	scan_wait(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	defrag d = { .next = TABLE + fs->sb.n_fat_blocks };
+	d.capacity = fs->sb.number_blocks < DEFRAG_WINDOW ? fs->sb.number_blocks : DEFRAG_WINDOW;
+	d.back = malloc(d.capacity * sizeof(int));
+	d.buff = malloc(2 * DEFRAG_BATCH * BLOCK_SIZE);
+	if (!d.back || !d.buff) {
+		free(d.back);
+		free(d.buff);
+		errno = ENOMEM;
+		return -1;
+	}
 
-	free(fat_temp);
+	// espera as operacoes em andamento: trava todos os arquivos, na ordem
+	// das entradas, e fica com dir_lock ate o fim
+	int locked = 0;
+	pthread_mutex_lock(&fs->dir_lock);
+	while (locked < fs->n_entries) {
+		pthread_rwlock_t *lock = &fs->dir[locked / N_ITEMS]->lock[locked % N_ITEMS];
+		pthread_mutex_unlock(&fs->dir_lock);
+		pthread_rwlock_wrlock(lock);
+		locked++;
+		pthread_mutex_lock(&fs->dir_lock);
+	}
 
-    return bytes_written;
+	d.files = malloc(fs->n_entries * sizeof(*d.files));
+	if (d.files) {
+		defrag_all(fs, &d);
+		free(d.files);
+	} else {
+		errno = ENOMEM;
+		d.moved = -1;
+	}
+
+	for (int slot = 0; slot < locked; slot++)
+		pthread_rwlock_unlock(&fs->dir[slot / N_ITEMS]->lock[slot % N_ITEMS]);
+	pthread_mutex_unlock(&fs->dir_lock);
+	free(d.back);
+	free(d.buff);
+	return d.moved;
+}
+
+// Takes a snapshot of the latency of the public calls
+void fat_get_stats(fat_fs *fs, fat_stats *st){
+	for (int op = 0; op < FAT_OPS; op++) {
+		st->calls[op] = __atomic_load_n(&fs->stats.calls[op], __ATOMIC_RELAXED);
+		st->nanos[op] = __atomic_load_n(&fs->stats.nanos[op], __ATOMIC_RELAXED);
+		for (int b = 0; b < FAT_LAT_BUCKETS; b++)
+			st->latency[op][b] = __atomic_load_n(&fs->stats.latency[op][b], __ATOMIC_RELAXED);
+	}
+}
+
+// Returns the name of a call timed by fat_get_stats
+const char *fat_op_name(int op){
+	static const char *names[FAT_OPS] = {
+		"create", "delete", "getsize", "read", "write", "open", "close",
+		"pread", "view", "pwrite", "fsync", "flush", "reserve", "defrag"
+	};
+	return op >= 0 && op < FAT_OPS ? names[op] : "?";
+}
+
+// Reads data from a file into a buffer  
+// Returns the number of bytes read
+int fat_read( fat_fs *fs, char *name, char *buff, int length, long offset){
+	TIMED(fs, FAT_OP_READ);
+	int fd = fat_open(fs, name);
+	if (fd < 0) return -1;
+	int result = fat_pread(fs, fd, buff, length, offset);
+	handle_close(fs, fd);
+	return result;
+}
+
+// Writes data from a buffer to a file. In delayed allocation mode the data
+// may stay buffered after the call, until the file is flushed.
+// Returns the number of bytes written
+int fat_write(fat_fs *fs, char *name, const char *buff, int length, long offset) {
+	TIMED(fs, FAT_OP_WRITE);
+	int fd = fat_open(fs, name);
+	if (fd < 0) return -1;
+	int result = fat_pwrite(fs, fd, buff, length, offset);
+	handle_close(fs, fd);
+	return result;
 }
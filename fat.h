@@ -1,11 +1,80 @@
+// A file system image on a disk from ds.h. Every function takes the file
+// system it works on, so one process may mount several images at once.
+typedef struct fat_fs fat_fs;
+struct ds_disk;
 
-void fat_debug();
-int  fat_format();
-int  fat_mount();
+fat_fs *fat_new( struct ds_disk *disk );
+void fat_free( fat_fs *fs );
 
-int  fat_create( char *name);
-int  fat_delete( char *name );
-int  fat_getsize( char *name);
+void fat_debug( fat_fs *fs );
+int  fat_format( fat_fs *fs );
+int  fat_mount( fat_fs *fs );
 
-int  fat_read( char *name, char *buff, int length, int offset );
-int  fat_write( char *name, const char *buff, int length, int offset );
+int  fat_create( fat_fs *fs, char *name );
+int  fat_delete( fat_fs *fs, char *name );
+long fat_getsize( fat_fs *fs, char *name );
+
+// Offsets and sizes are in bytes and 64 bits wide; one call moves at most
+// INT_MAX bytes
+int  fat_read( fat_fs *fs, char *name, char *buff, int length, long offset );
+int  fat_write( fat_fs *fs, char *name, const char *buff, int length, long offset );
+
+int  fat_open( fat_fs *fs, char *name );
+int  fat_pread( fat_fs *fs, int fd, char *buff, int length, long offset );
+int  fat_pwrite( fat_fs *fs, int fd, const char *buff, int length, long offset );
+int  fat_pread_view( fat_fs *fs, int fd, long offset, const char **view );
+int  fat_close( fat_fs *fs, int fd );
+int  fat_readahead( fat_fs *fs, int fd );
+int  fat_reserve( fat_fs *fs, int fd, long size );
+int  fat_fsync( fat_fs *fs, int fd );
+int  fat_flush( fat_fs *fs );
+
+void fat_set_index( fat_fs *fs, int enable );
+int  fat_set_delalloc( fat_fs *fs, int enable );
+int  fat_set_lazy( fat_fs *fs, int pages );
+
+// Fragmentation of an image. A file whose blocks are all consecutive has a
+// single extent, so extents equals files when nothing is fragmented.
+typedef struct{
+	int files;          // Files with at least one block
+	int blocks;         // Blocks in their chains
+	int extents;        // Runs of consecutive blocks in their chains
+	int fragmented;     // Files with more than one extent
+	int free_runs;      // Runs of free blocks
+	int largest_free;   // Longest run of free blocks
+} fat_frag;
+
+int  fat_fragmentation( fat_fs *fs, fat_frag *frag );
+int  fat_defrag( fat_fs *fs );
+
+int  fat_meta_writes();
+
+// Calls timed by fat_get_stats
+#define FAT_OP_CREATE   0
+#define FAT_OP_DELETE   1
+#define FAT_OP_GETSIZE  2
+#define FAT_OP_READ     3
+#define FAT_OP_WRITE    4
+#define FAT_OP_OPEN     5
+#define FAT_OP_CLOSE    6
+#define FAT_OP_PREAD    7
+#define FAT_OP_VIEW     8
+#define FAT_OP_PWRITE   9
+#define FAT_OP_FSYNC    10
+#define FAT_OP_FLUSH    11
+#define FAT_OP_RESERVE  12
+#define FAT_OP_DEFRAG   13
+#define FAT_OPS         14
+
+// Latency buckets: bucket 0 counts calls under 1 us, bucket i calls from
+// 2^(i-1) up to 2^i us, and the last bucket everything slower
+#define FAT_LAT_BUCKETS 24
+
+typedef struct{
+	long calls[FAT_OPS];                    // Calls made
+	long nanos[FAT_OPS];                    // Time spent in them, in nanoseconds
+	long latency[FAT_OPS][FAT_LAT_BUCKETS]; // Calls by latency bucket
+} fat_stats;
+
+void fat_get_stats( fat_fs *fs, fat_stats *st );
+const char *fat_op_name( int op );
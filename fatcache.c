@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ds.h"
+#include "fatcache.h"
+
+static unsigned int get16( const char *entries, unsigned int k )
+{
+	return ((const uint16_t *)entries)[k];
+}
+
+static unsigned int get32( const char *entries, unsigned int k )
+{
+	return ((const uint32_t *)entries)[k];
+}
+
+static void set16( char *entries, unsigned int k, unsigned int value )
+{
+	((uint16_t *)entries)[k] = value;
+}
+
+static void set32( char *entries, unsigned int k, unsigned int value )
+{
+	((uint32_t *)entries)[k] = value;
+}
+
+static const fat_entry_access access16 = { get16, set16 };
+static const fat_entry_access access32 = { get32, set32 };
+
+// Returns the accessors of FAT entries width bytes wide, 2 or 4
+const fat_entry_access *fat_entries( int width )
+{
+	return width == 2 ? &access16 : &access32;
+}
+
+// Prepares a cache of capacity pages for the n_blocks FAT blocks starting
+// at disk block first, with entries width bytes wide. Returns 0, or -1
+// with errno set.
+int fatcache_init( fat_cache *c, struct ds_disk *disk, int first, int n_blocks, int width, int capacity )
+{
+	if(capacity < 1 || (width != 2 && width != 4)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(c, 0, sizeof(*c));
+	if(capacity > n_blocks) capacity = n_blocks;
+	c->disk = disk;
+	c->first = first;
+	c->n_blocks = n_blocks;
+	c->per_page = FAT_ENTRIES(width);
+	c->access = fat_entries(width);
+	c->capacity = capacity;
+	c->buckets = 2 * capacity + 1;
+	c->pages = calloc(capacity, sizeof(fat_page));
+	c->data = malloc((size_t)capacity * BLOCK_SIZE);
+	c->table = calloc(c->buckets, sizeof(fat_page *));
+	if(!c->pages || !c->data || !c->table) {
+		free(c->pages);
+		free(c->data);
+		free(c->table);
+		memset(c, 0, sizeof(*c));
+		errno = ENOMEM;
+		return -1;
+	}
+	// every page starts unused, chained in the LRU list
+	for(int i = 0; i < capacity; i++) {
+		fat_page *p = &c->pages[i];
+		p->number = -1;
+		p->entries = c->data + (size_t)i * BLOCK_SIZE;
+		p->prev = i ? &c->pages[i - 1] : NULL;
+		p->next = i < capacity - 1 ? &c->pages[i + 1] : NULL;
+	}
+	c->head = &c->pages[0];
+	c->tail = &c->pages[capacity - 1];
+	pthread_mutex_init(&c->lock, NULL);
+	return 0;
+}
+
+// Releases the cache memory. Changed blocks not synced are lost.
+void fatcache_destroy( fat_cache *c )
+{
+	if(!c->pages) return;
+	free(c->pages);
+	free(c->data);
+	free(c->table);
+	pthread_mutex_destroy(&c->lock);
+	memset(c, 0, sizeof(*c));
+}
+
+// Moves a page to the head of the LRU list (most recently used)
+static void lru_touch( fat_cache *c, fat_page *p )
+{
+	if(c->head == p) return;
+	if(p->prev) p->prev->next = p->next;
+	if(p->next) p->next->prev = p->prev; else c->tail = p->prev;
+	p->prev = NULL;
+	p->next = c->head;
+	c->head->prev = p;
+	c->head = p;
+}
+
+// Finds the page holding a FAT block, or NULL if it is not loaded
+static fat_page *lookup( fat_cache *c, int number )
+{
+	fat_page *p = c->table[number % c->buckets];
+	while(p && p->number != number) p = p->hnext;
+	return p;
+}
+
+// Returns the page holding a FAT block, reading it into the least recently
+// used page if needed; that page is written back first if it changed.
+// Called with the lock held.
+static fat_page *load( fat_cache *c, int number )
+{
+	fat_page *p = lookup(c, number);
+	if(!p) {
+		p = c->tail;
+		if(p->number >= 0) {
+			if(p->dirty) {
+				ds_write(c->disk, c->first + p->number, p->entries);
+				c->written++;
+			}
+			fat_page **h = &c->table[p->number % c->buckets];
+			while(*h != p) h = &(*h)->hnext;
+			*h = p->hnext;
+		}
+		ds_read(c->disk, c->first + number, p->entries);
+		p->number = number;
+		p->dirty = 0;
+		p->hnext = c->table[number % c->buckets];
+		c->table[number % c->buckets] = p;
+	}
+	lru_touch(c, p);
+	return p;
+}
+
+// Returns a FAT entry
+unsigned int fatcache_get( fat_cache *c, unsigned int entry )
+{
+	pthread_mutex_lock(&c->lock);
+	unsigned int value = c->access->get(load(c, entry / c->per_page)->entries, entry % c->per_page);
+	pthread_mutex_unlock(&c->lock);
+	return value;
+}
+
+// Changes a FAT entry; its block is written back when evicted or synced
+void fatcache_set( fat_cache *c, unsigned int entry, unsigned int value )
+{
+	pthread_mutex_lock(&c->lock);
+	fat_page *p = load(c, entry / c->per_page);
+	c->access->set(p->entries, entry % c->per_page, value);
+	p->dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Copies FAT block number into buff, from its page if it is loaded and
+// from the disk otherwise, without loading it
+void fatcache_read( fat_cache *c, int number, char *buff )
+{
+	pthread_mutex_lock(&c->lock);
+	fat_page *p = lookup(c, number);
+	if(p) memcpy(buff, p->entries, BLOCK_SIZE);
+	else ds_read(c->disk, c->first + number, buff);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Writes back the changed pages. Returns the number of FAT blocks written
+// since the last call, counting those written back by evictions.
+int fatcache_sync( fat_cache *c )
+{
+	pthread_mutex_lock(&c->lock);
+	int written = c->written;
+	for(int i = 0; i < c->capacity; i++) {
+		fat_page *p = &c->pages[i];
+		if(p->number >= 0 && p->dirty) {
+			ds_write(c->disk, c->first + p->number, p->entries);
+			p->dirty = 0;
+			written++;
+		}
+	}
+	c->written = 0;
+	pthread_mutex_unlock(&c->lock);
+	return written;
+}
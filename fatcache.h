@@ -0,0 +1,56 @@
+// FAT blocks loaded on demand: a fixed number of them is kept in memory,
+// in LRU order, and a changed block is written back when it is evicted or
+// at the next fatcache_sync. Every function may be called from several
+// threads.
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A FAT entry is 2 or 4 bytes wide, as chosen at format time, so a FAT
+// block holds FAT_ENTRIES(width) of them. BLOCK_SIZE comes from ds.h.
+#define FAT_ENTRIES(width) (BLOCK_SIZE / (width))
+
+// Reads and changes entry k of the FAT entries at entries. There is one
+// pair of functions per entry width, picked once with fat_entries, so the
+// width is not tested on every access.
+typedef struct{
+	unsigned int (*get)( const char *entries, unsigned int k );
+	void (*set)( char *entries, unsigned int k, unsigned int value );
+} fat_entry_access;
+
+const fat_entry_access *fat_entries( int width );
+
+struct ds_disk;
+
+typedef struct fat_page {
+	int number;                 // FAT block held, -1 if none
+	int dirty;                  // 1 if changed since it was read or written
+	char *entries;              // Contents of the block
+	struct fat_page *prev;      // Previous page in the LRU list (more recent)
+	struct fat_page *next;      // Next page in the LRU list (less recent)
+	struct fat_page *hnext;     // Next page in the same hash bucket
+} fat_page;
+
+typedef struct{
+	struct ds_disk *disk;       // Disk holding the FAT
+	int first;                  // Disk block of FAT block 0
+	int n_blocks;               // Number of FAT blocks
+	int per_page;               // FAT entries per block
+	const fat_entry_access *access; // Accessors for the entry width
+	int capacity;               // Number of pages
+	fat_page *pages;            // Storage for all pages
+	char *data;                 // Block storage for all pages
+	fat_page **table;           // Hash table of the pages in use
+	int buckets;                // Number of buckets in table
+	fat_page *head;             // Most recently used page
+	fat_page *tail;             // Least recently used page
+	int written;                // Blocks written back by evictions since the last fatcache_sync
+	pthread_mutex_t lock;
+} fat_cache;
+
+int  fatcache_init( fat_cache *c, struct ds_disk *disk, int first, int n_blocks, int width, int capacity );
+void fatcache_destroy( fat_cache *c );
+unsigned int fatcache_get( fat_cache *c, unsigned int entry );
+void fatcache_set( fat_cache *c, unsigned int entry, unsigned int value );
+void fatcache_read( fat_cache *c, int number, char *buff );
+int  fatcache_sync( fat_cache *c );